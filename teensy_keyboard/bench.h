@@ -0,0 +1,34 @@
+/**
+ * Debug pins for timing measurements on the real firmware
+ *
+ * With BENCH_PINS defined, PD0-PD4 go high while the firmware is in one of
+ * the parts below, so a logic analyzer on the Teensy or the VCD trace of
+ * "make bench-sim" shows how long each one takes and how often it runs.
+ * Setting and clearing a pin takes two cycles each.
+ * Without BENCH_PINS all macros are empty.
+ *
+ * @author Lukas Zurschmiede <l.zurschmiede@ranta.ch>
+ * @package teensy_keyboard
+ * @license GPL-v3
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#define BENCH_PIN_USB_GEN 0 // PD0: USB device interrupt, start of frame and bus reset
+#define BENCH_PIN_USB_COM 1 // PD1: USB endpoint interrupt, the control requests on endpoint 0
+#define BENCH_PIN_REPORT  2 // PD2: A report is written into a keyboard endpoint
+#define BENCH_PIN_WAIT    3 // PD3: queue_report() sleeps until there is space in the queue
+#define BENCH_PIN_LOOKUP  4 // PD4: A character is looked up in the keyboard layout
+
+#ifdef BENCH_PINS
+#define BENCH_INIT()   (DDRD |= 0x1F, PORTD &= ~0x1F)
+#define BENCH_ON(pin)  (PORTD |= (1 << (pin)))
+#define BENCH_OFF(pin) (PORTD &= ~(1 << (pin)))
+#else
+#define BENCH_INIT()
+#define BENCH_ON(pin)
+#define BENCH_OFF(pin)
+#endif
+
+#endif
@@ -0,0 +1,19 @@
+/**
+ * The interrupts on the host, see check/mock/avr/io.h. The interrupt
+ * routines are normal functions check/usb_host.c calls while the firmware
+ * sleeps.
+ */
+
+#ifndef MOCK_AVR_INTERRUPT_H
+#define MOCK_AVR_INTERRUPT_H
+
+#include <avr/io.h>
+
+#define ISR(vector) void vector(void)
+#define cli() (SREG &= ~0x80)
+#define sei() (SREG |= 0x80)
+
+void USB_GEN_vect(void);
+void USB_COM_vect(void);
+
+#endif
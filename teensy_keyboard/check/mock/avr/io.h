@@ -0,0 +1,109 @@
+/**
+ * The registers of the ATmega32U4 the firmware uses, as plain variables, so
+ * keyboard_payload.c and usb_keyboard.c run on the host against the USB host
+ * in check/usb_host.c, see "make check".
+ *
+ * The endpoint registers are the ones of the endpoint UENUM selects. UEINTX,
+ * UEDATX, UESTA0X and PLLCSR are reached through a function, because on the
+ * chip each access does something: a 0 written to a flag of UEINTX only
+ * clears it and clearing TXINI or FIFOCON hands the bank to the host, UEDATX
+ * reads or writes the next byte of the bank, UESTA0X counts the busy banks
+ * and the PLL locks. The function first catches up with what the firmware
+ * wrote since the last access.
+ *
+ * @author Lukas Zurschmiede <l.zurschmiede@ranta.ch>
+ * @package teensy_keyboard
+ * @license GPL-v3
+ */
+
+#ifndef MOCK_AVR_IO_H
+#define MOCK_AVR_IO_H
+
+#include <stdint.h>
+
+#ifndef __AVR_ATmega32U4__
+#define __AVR_ATmega32U4__
+#endif
+
+extern volatile uint8_t SREG, MCUSR, CLKPR;
+extern volatile uint8_t DDRB, PORTB, PINB, DDRD, PORTD;
+extern volatile uint8_t TCCR1A, TCCR1B;
+extern volatile uint16_t TCNT1;
+extern volatile uint8_t UHWCON, USBCON, UDCON, UDIEN, UDINT, UDADDR, UDFNUML;
+extern volatile uint8_t UENUM, UERST;
+
+#define MOCK_ENDPOINTS	5
+#define MOCK_BANK_SIZE	64
+
+/**
+ * An endpoint: its registers, the bank the firmware reads or writes and
+ * the banks of an IN endpoint waiting for the host
+ */
+struct mock_endpoint {
+	uint8_t ueconx, uecfg0x, uecfg1x, ueienx, ueintx, uesta0x;
+	uint8_t flags;	// UEINTX as the hardware has set it, see mock_update()
+	uint8_t fifo[MOCK_BANK_SIZE];
+	uint8_t pos;
+	uint8_t banks;
+	uint8_t bank[2][MOCK_BANK_SIZE];
+	uint8_t bank_length[2];
+};
+extern struct mock_endpoint mock_endpoints[MOCK_ENDPOINTS];
+
+volatile uint8_t *mock_ueintx(void);
+volatile uint8_t *mock_uedatx(void);
+volatile uint8_t *mock_uesta0x(void);
+volatile uint8_t *mock_pllcsr(void);
+
+#define UECONX	(mock_endpoints[UENUM].ueconx)
+#define UECFG0X	(mock_endpoints[UENUM].uecfg0x)
+#define UECFG1X	(mock_endpoints[UENUM].uecfg1x)
+#define UEIENX	(mock_endpoints[UENUM].ueienx)
+#define UEINTX	(*mock_ueintx())
+#define UEDATX	(*mock_uedatx())
+#define UESTA0X	(*mock_uesta0x())
+#define PLLCSR	(*mock_pllcsr())
+
+// PLLCSR
+#define PLOCK	0
+#define PLLE	1
+#define PINDIV	4
+// USBCON
+#define VBUSTE	0
+#define OTGPADE	4
+#define FRZCLK	5
+#define USBE	7
+// UDIEN and UDINT
+#define SUSPE	0
+#define SOFE	2
+#define EORSTE	3
+#define WAKEUPE	4
+#define SUSPI	0
+#define SOFI	2
+#define EORSTI	3
+#define WAKEUPI	4
+// UDADDR
+#define ADDEN	7
+// UECONX
+#define EPEN	0
+#define RSTDT	3
+#define STALLRQC 4
+#define STALLRQ	5
+// UEINTX and UEIENX
+#define TXINI	0
+#define STALLEDI 1
+#define RXOUTI	2
+#define RXSTPI	3
+#define NAKOUTI	4
+#define RWAL	5
+#define NAKINI	6
+#define FIFOCON	7
+#define TXINE	0
+#define RXOUTE	2
+#define RXSTPE	3
+// TCCR1B
+#define CS10	0
+// MCUSR
+#define WDRF	3
+
+#endif
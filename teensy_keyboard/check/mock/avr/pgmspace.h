@@ -0,0 +1,12 @@
+/**
+ * The flash is normal memory on the host, see check/mock/avr/io.h
+ */
+
+#ifndef MOCK_AVR_PGMSPACE_H
+#define MOCK_AVR_PGMSPACE_H
+
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(addr))
+
+#endif
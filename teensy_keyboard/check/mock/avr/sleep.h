@@ -0,0 +1,19 @@
+/**
+ * Sleeping on the host is one frame of the USB host in check/usb_host.c,
+ * see check/mock/avr/io.h
+ */
+
+#ifndef MOCK_AVR_SLEEP_H
+#define MOCK_AVR_SLEEP_H
+
+#define SLEEP_MODE_IDLE		0
+#define SLEEP_MODE_PWR_DOWN	2
+
+void mock_sleep(void);
+
+#define set_sleep_mode(mode)
+#define sleep_enable()
+#define sleep_cpu() mock_sleep()
+#define sleep_disable()
+
+#endif
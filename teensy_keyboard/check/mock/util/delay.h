@@ -0,0 +1,10 @@
+/**
+ * The busy waits take no time on the host, see check/mock/avr/io.h
+ */
+
+#ifndef MOCK_UTIL_DELAY_H
+#define MOCK_UTIL_DELAY_H
+
+#define _delay_ms(ms)
+
+#endif
@@ -0,0 +1,589 @@
+/**
+ * The USB host of "make check": it runs the firmware, keyboard_payload.c and
+ * usb_keyboard.c, against the registers in check/mock and prints what it
+ * takes from each keyboard endpoint in each frame.
+ *
+ * Each time the firmware sleeps one frame passes: the host sends the start
+ * of frame, polls each keyboard endpoint once, in the order of their numbers,
+ * and does at most one control transfer. It enumerates the keyboard like
+ * Linux does, out of the descriptors it reads, switches its lock LEDs when a
+ * lock key is pressed and sends them LED_DELAY frames later. At the end it
+ * reads the counters.
+ * shell> ./check/usb_host [boot] [reverse] [reset=FRAME]... [suspend=FRAME+FRAMES]...
+ * boot: the host selects the boot protocol like a BIOS does
+ * reverse: the endpoints are polled from the highest number down
+ * reset=FRAME: a bus reset in the frame, the reports in the banks are lost
+ * suspend=FRAME+FRAMES: the bus is suspended for the given frames
+ *
+ * @author Lukas Zurschmiede <l.zurschmiede@ranta.ch>
+ * @version 0.1
+ * @package teensy_keyboard
+ * @license GPL-v3
+ */
+
+/* License:
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#define USB_SERIAL_PRIVATE_INCLUDE
+#include "usb_keyboard.h"
+
+// The payload hangs if it runs longer, and the frames after its end for the last reports
+#define MAX_FRAMES	1000000UL
+#define DRAIN_FRAMES	10
+
+// Frames the host takes to send the LEDs after a lock key
+#define LED_DELAY	3
+
+// The address the host gives the keyboard
+#define USB_ADDRESS	7
+
+// Most interfaces, bus resets and suspends the host handles
+#define MAX_INTERFACES	4
+#define MAX_EVENTS	16
+
+// The enumeration_step before the keyboard is attached and after its enumeration
+#define DETACHED	-1
+#define ENUMERATED	1000
+
+volatile uint8_t SREG, MCUSR, CLKPR;
+volatile uint8_t DDRB, PORTB, PINB = 0xFF, DDRD, PORTD;
+volatile uint8_t TCCR1A, TCCR1B;
+volatile uint16_t TCNT1;
+volatile uint8_t UHWCON, USBCON, UDCON = 1, UDIEN, UDINT, UDADDR, UDFNUML;
+volatile uint8_t UENUM, UERST;
+struct mock_endpoint mock_endpoints[MOCK_ENDPOINTS];
+static volatile uint8_t pllcsr;
+
+/**
+ * The main() of keyboard_payload.c, renamed by the Makefile
+ */
+int firmware_main(void);
+
+/**
+ * The milliseconds since the start, and the data the host got in the IN
+ * stage of the last control transfer
+ */
+static unsigned long frame;
+static uint8_t control_in[256];
+static unsigned control_in_length;
+
+/**
+ * The options, see the top of the file
+ */
+static uint8_t boot_protocol, reverse_poll;
+static unsigned long resets[MAX_EVENTS], suspends[MAX_EVENTS], suspend_frames[MAX_EVENTS];
+static int reset_count, suspend_count;
+
+/**
+ * What the host knows about the keyboard: how far it is enumerated, the
+ * interfaces and the interface of each endpoint, 0xFF if it has none
+ */
+static int enumeration_step = DETACHED;
+static uint8_t interfaces;
+static uint8_t endpoint_interface[MOCK_ENDPOINTS];
+
+/**
+ * The keys each interface has pressed, the reports the host took on it,
+ * the LEDs and the frame to send them in, 0 if they are sent
+ */
+static uint8_t host_keys[MAX_INTERFACES][KEYBOARD_BITMAP_SIZE];
+static unsigned long host_reports[MAX_INTERFACES];
+static uint8_t host_leds;
+static unsigned long leds_frame;
+
+/**
+ * The frames the bus is suspended yet
+ */
+static unsigned long suspended;
+
+/**
+ * Catch up with what the firmware wrote to the UEINTX of an endpoint since
+ * the last time and set the flags of the hardware again
+ *
+ * @param n The endpoint
+ */
+static void update_endpoint(uint8_t n) {
+	struct mock_endpoint *e = &mock_endpoints[n];
+	uint8_t cleared = e->flags & ~e->ueintx;
+
+	if (n == 0) {
+		// A setup or OUT packet read, the next one starts at the front
+		if (cleared & ((1 << RXSTPI) | (1 << RXOUTI))) {
+			e->pos = 0;
+		}
+		// The IN packet goes to the host at once, the bank is free again
+		if (cleared & (1 << TXINI)) {
+			if (control_in_length + e->pos <= sizeof(control_in)) {
+				memcpy(control_in + control_in_length, e->fifo, e->pos);
+				control_in_length += e->pos;
+			}
+			e->pos = 0;
+		}
+		e->flags = (e->flags & ~cleared) | (1 << TXINI);
+	} else {
+		// Clearing FIFOCON hands the bank to the host, the next one is written
+		if ((cleared & (1 << FIFOCON)) && (e->banks < 2)) {
+			memcpy(e->bank[e->banks], e->fifo, e->pos);
+			e->bank_length[e->banks] = e->pos;
+			e->banks++;
+			e->pos = 0;
+		}
+		e->flags &= ~cleared;
+		if ((e->ueconx & (1 << EPEN)) && (e->banks < 2)) {
+			e->flags |= (1 << TXINI) | (1 << RWAL) | (1 << FIFOCON);
+		} else {
+			e->flags &= ~((1 << TXINI) | (1 << RWAL) | (1 << FIFOCON));
+		}
+	}
+	e->ueintx = e->flags;
+	e->uesta0x = e->banks;
+}
+
+/**
+ * Catch up with all endpoints, see update_endpoint()
+ */
+static void mock_update(void) {
+	uint8_t n;
+
+	for (n = 0; n < MOCK_ENDPOINTS; n++) {
+		update_endpoint(n);
+	}
+}
+
+/**
+ * Implementation of the registers in check/mock/avr/io.h
+ */
+volatile uint8_t *mock_ueintx(void) {
+	mock_update();
+	return &mock_endpoints[UENUM].ueintx;
+}
+
+volatile uint8_t *mock_uedatx(void) {
+	struct mock_endpoint *e = &mock_endpoints[UENUM];
+
+	mock_update();
+	if (e->pos < MOCK_BANK_SIZE - 1) {
+		return &e->fifo[e->pos++];
+	}
+	return &e->fifo[e->pos];
+}
+
+volatile uint8_t *mock_uesta0x(void) {
+	mock_update();
+	return &mock_endpoints[UENUM].uesta0x;
+}
+
+volatile uint8_t *mock_pllcsr(void) {
+	if (pllcsr & (1 << PLLE)) {
+		pllcsr |= (1 << PLOCK);
+	}
+	return &pllcsr;
+}
+
+/**
+ * Raise USB device interrupts, USB_GEN_vect runs if they are enabled
+ *
+ * @param bits The UDINT bits
+ */
+static void usb_gen_interrupt(uint8_t bits) {
+	UDINT |= bits;
+	if (UDINT & UDIEN) {
+		USB_GEN_vect();
+	}
+	mock_update();
+}
+
+/**
+ * Run USB_COM_vect if endpoint 0 has an enabled interrupt
+ */
+static void usb_com_interrupt(void) {
+	struct mock_endpoint *e = &mock_endpoints[0];
+
+	mock_update();
+	if (e->ueienx & e->ueintx & ((1 << TXINE) | (1 << RXOUTE) | (1 << RXSTPE))) {
+		USB_COM_vect();
+		mock_update();
+	}
+}
+
+/**
+ * Do a control transfer on endpoint 0, the IN data is in control_in
+ *
+ * @param type bmRequestType
+ * @param request bRequest
+ * @param value wValue
+ * @param index wIndex
+ * @param length wLength
+ * @param *data The OUT data, length bytes
+ * @return The bytes the keyboard sent, -1 if it stalled
+ */
+static int control(uint8_t type, uint8_t request, uint16_t value, uint16_t index, uint16_t length, const uint8_t *data) {
+	struct mock_endpoint *e = &mock_endpoints[0];
+	uint8_t setup[8] = { type, request, value, value >> 8, index, index >> 8, length, length >> 8 };
+	int i;
+
+	control_in_length = 0;
+	mock_update();
+	memcpy(e->fifo, setup, sizeof(setup));
+	e->pos = 0;
+	e->flags |= (1 << RXSTPI);
+	e->ueintx = e->flags;
+	usb_com_interrupt();
+	if (!(type & 0x80) && length && !(e->ueconx & (1 << STALLRQ))) {
+		memcpy(e->fifo, data, length);
+		e->pos = 0;
+		e->flags |= (1 << RXOUTI);
+		e->ueintx = e->flags;
+		usb_com_interrupt();
+	}
+	// The IN packets of the data or the status stage, the host takes each one at once
+	for (i = 0; (i < 16) && (e->ueienx & (1 << TXINE)); i++) {
+		usb_com_interrupt();
+	}
+	if (e->ueconx & (1 << STALLRQ)) {
+		e->ueconx &= ~(1 << STALLRQ);
+		return -1;
+	}
+	return control_in_length;
+}
+
+/**
+ * Read the interfaces and the endpoint of each out of the configuration descriptor
+ */
+static void read_configuration(void) {
+	unsigned pos;
+	uint8_t interface = 0;
+
+	interfaces = control_in[4];
+	memset(endpoint_interface, 0xFF, sizeof(endpoint_interface));
+	for (pos = 0; pos + 1 < control_in_length && control_in[pos]; pos += control_in[pos]) {
+		if (control_in[pos + 1] == 4) {
+			interface = control_in[pos + 2];
+		} else if ((control_in[pos + 1] == 5) && ((control_in[pos + 2] & 0x0F) < MOCK_ENDPOINTS)) {
+			endpoint_interface[control_in[pos + 2] & 0x0F] = interface;
+		}
+	}
+}
+
+/**
+ * Send the LEDs to all interfaces
+ */
+static void send_leds(void) {
+	uint8_t i;
+
+	printf("%6lu LEDs %02x\n", frame, host_leds);
+	for (i = 0; i < interfaces; i++) {
+		if (control(0x21, HID_SET_REPORT, 0x0200, i, 1, &host_leds) < 0) {
+			printf("%6lu interface %d stalls the LEDs\n", frame, i);
+		}
+	}
+}
+
+/**
+ * The next step of the enumeration, one control transfer each frame: the
+ * descriptors, the address and the configuration, then for each interface
+ * its report descriptor, the idle rate, the protocol and the LEDs
+ */
+static void enumerate(void) {
+	int step = enumeration_step++, length;
+	uint8_t interface;
+
+	switch (step) {
+		case 0:
+			length = control(0x80, GET_DESCRIPTOR, 0x0100, 0, 64, NULL);
+			printf("%6lu device descriptor, %d bytes, %02x%02x:%02x%02x\n", frame, length,
+				control_in[9], control_in[8], control_in[11], control_in[10]);
+			return;
+		case 1:
+			control(0x00, SET_ADDRESS, USB_ADDRESS, 0, 0, NULL);
+			printf("%6lu address %d%s\n", frame, UDADDR & 0x7F, (UDADDR & (1 << ADDEN)) ? "" : ", not enabled");
+			return;
+		case 2:
+			length = control(0x80, GET_DESCRIPTOR, 0x0200, 0, 255, NULL);
+			read_configuration();
+			printf("%6lu configuration descriptor, %d bytes, %d interfaces\n", frame, length, interfaces);
+			return;
+		case 3:
+			control(0x00, SET_CONFIGURATION, 1, 0, 0, NULL);
+			printf("%6lu configuration %d\n", frame, usb_configured());
+			return;
+	}
+	interface = (step - 4) / 4;
+	if (interface >= interfaces || interface >= MAX_INTERFACES) {
+		enumeration_step = ENUMERATED;
+		return;
+	}
+	switch ((step - 4) % 4) {
+		case 0:
+			length = control(0x81, GET_DESCRIPTOR, 0x2200, interface, 255, NULL);
+			printf("%6lu interface %d report descriptor, %d bytes\n", frame, interface, length);
+			break;
+		case 1:
+			control(0x21, HID_SET_IDLE, 0, interface, 0, NULL);
+			break;
+		case 2:
+			if (boot_protocol) {
+				control(0x21, HID_SET_PROTOCOL, 0, interface, 0, NULL);
+				printf("%6lu interface %d boot protocol\n", frame, interface);
+			}
+			break;
+		case 3:
+			if (control(0x21, HID_SET_REPORT, 0x0200, interface, 1, &host_leds) < 0) {
+				printf("%6lu interface %d stalls the LEDs\n", frame, interface);
+			}
+			break;
+	}
+}
+
+/**
+ * Reset the bus: the keyboard endpoints are off and the reports still in
+ * their banks are lost, the host releases all keys and enumerates again
+ */
+static void bus_reset(void) {
+	uint8_t n, lost = 0;
+
+	for (n = 1; n < MOCK_ENDPOINTS; n++) {
+		lost += mock_endpoints[n].banks;
+		memset(&mock_endpoints[n], 0, sizeof(mock_endpoints[n]));
+	}
+	printf("%6lu bus reset, %d reports lost in the banks\n", frame, lost);
+	memset(host_keys, 0, sizeof(host_keys));
+	leds_frame = 0;
+	UDADDR = 0;
+	enumeration_step = 0;
+	usb_gen_interrupt(1 << EORSTI);
+}
+
+/**
+ * Toggle the LED of a lock key the host sees pressed now
+ *
+ * @param interface The interface of the report
+ * @param *keys The keys pressed in the report
+ * @param key The lock key
+ * @param led The KEYBOARD_LED_* of the key
+ */
+static void lock_key(uint8_t interface, const uint8_t *keys, uint8_t key, uint8_t led) {
+	uint8_t i;
+
+	if (!(keys[key >> 3] & (1 << (key & 7)))) {
+		return;
+	}
+	// Held down on any keyboard before, the host merges them all
+	for (i = 0; i < MAX_INTERFACES; i++) {
+		if (host_keys[i][key >> 3] & (1 << (key & 7))) {
+			return;
+		}
+	}
+	host_leds ^= led;
+	if (!leds_frame) {
+		leds_frame = frame + LED_DELAY;
+	}
+}
+
+/**
+ * Take the next report from a keyboard endpoint and print it: the
+ * modifier, the reserved byte and the keys of the bitmap, or all bytes of
+ * a boot report
+ *
+ * @param n The endpoint
+ */
+static void poll_endpoint(uint8_t n) {
+	struct mock_endpoint *e = &mock_endpoints[n];
+	uint8_t keys[KEYBOARD_BITMAP_SIZE] = { 0 };
+	uint8_t interface = endpoint_interface[n], *report = e->bank[0], length, i;
+
+	mock_update();
+	length = e->bank_length[0];
+	if (!(e->ueconx & (1 << EPEN))) {
+		return;
+	}
+	if (!e->banks) {
+		// NAK, nothing to send
+		e->flags |= (1 << NAKINI);
+		e->ueintx = e->flags;
+		return;
+	}
+	printf("%6lu EP%d", frame, n);
+	if (!boot_protocol && (length == 2 + KEYBOARD_BITMAP_SIZE)) {
+		printf(" %02x %02x :", report[0], report[1]);
+		for (i = 0; i < KEYBOARD_BITMAP_SIZE * 8; i++) {
+			if (report[2 + (i >> 3)] & (1 << (i & 7))) {
+				printf(" %02x", i);
+			}
+		}
+		memcpy(keys, report + 2, KEYBOARD_BITMAP_SIZE);
+	} else {
+		for (i = 0; i < length; i++) {
+			printf(" %02x", report[i]);
+			if ((i >= 2) && (report[i] > 1) && (report[i] < KEYBOARD_BITMAP_SIZE * 8)) {
+				keys[report[i] >> 3] |= (1 << (report[i] & 7));
+			}
+		}
+	}
+	printf("\n");
+	if (interface < MAX_INTERFACES) {
+		// Not pressed on this keyboard before, see lock_key()
+		for (i = 0; i < KEYBOARD_BITMAP_SIZE; i++) {
+			keys[i] &= ~host_keys[interface][i];
+		}
+		lock_key(interface, keys, KEY_NUM_LOCK, KEYBOARD_LED_NUM_LOCK);
+		lock_key(interface, keys, KEY_CAPS_LOCK, KEYBOARD_LED_CAPS_LOCK);
+		lock_key(interface, keys, KEY_SCROLL_LOCK, KEYBOARD_LED_SCROLL_LOCK);
+		memset(host_keys[interface], 0, KEYBOARD_BITMAP_SIZE);
+		if (!boot_protocol && (length == 2 + KEYBOARD_BITMAP_SIZE)) {
+			memcpy(host_keys[interface], report + 2, KEYBOARD_BITMAP_SIZE);
+		} else {
+			for (i = 2; i < length; i++) {
+				if ((report[i] > 1) && (report[i] < KEYBOARD_BITMAP_SIZE * 8)) {
+					host_keys[interface][report[i] >> 3] |= (1 << (report[i] & 7));
+				}
+			}
+		}
+		host_reports[interface]++;
+	}
+	e->banks--;
+	memmove(e->bank[0], e->bank[1], MOCK_BANK_SIZE);
+	e->bank_length[0] = e->bank_length[1];
+	update_endpoint(n);
+}
+
+/**
+ * One frame of the host: the bus events of the options, the start of
+ * frame, the polls of the keyboard endpoints and a control transfer
+ */
+static void host_frame(void) {
+	int i, n;
+
+	frame++;
+	if (frame > MAX_FRAMES) {
+		printf("%6lu the payload hangs\n", frame);
+		exit(1);
+	}
+	// The keyboard attaches when usb_init() has started the USB and the pull-up
+	if (enumeration_step == DETACHED) {
+		if ((USBCON & (1 << USBE)) && !(USBCON & (1 << FRZCLK)) && !(UDCON & 1)) {
+			bus_reset();
+		}
+		return;
+	}
+	for (i = 0; i < reset_count; i++) {
+		if (resets[i] == frame) {
+			bus_reset();
+		}
+	}
+	if (suspended) {
+		if (--suspended) {
+			return;
+		}
+		printf("%6lu resume\n", frame);
+		usb_gen_interrupt(1 << WAKEUPI);
+	}
+	for (i = 0; i < suspend_count; i++) {
+		if (suspends[i] == frame) {
+			printf("%6lu suspend\n", frame);
+			suspended = suspend_frames[i];
+			usb_gen_interrupt(1 << SUSPI);
+			return;
+		}
+	}
+
+	UDFNUML = frame;
+	usb_gen_interrupt(1 << SOFI);
+	for (i = 0; i < MOCK_ENDPOINTS; i++) {
+		n = reverse_poll ? MOCK_ENDPOINTS - 1 - i : i;
+		if (endpoint_interface[n] != 0xFF) {
+			poll_endpoint(n);
+		}
+	}
+	if (enumeration_step < ENUMERATED) {
+		enumerate();
+	} else if (leds_frame && (frame >= leds_frame)) {
+		leds_frame = 0;
+		send_leds();
+	}
+}
+
+/**
+ * Implementation of sleep_cpu() in check/mock/avr/sleep.h, the next
+ * interrupt comes at the latest with the next frame
+ */
+void mock_sleep(void) {
+	host_frame();
+}
+
+/**
+ * Read the counters and check that they can not be written
+ */
+static void read_counters(void) {
+	struct keyboard_stats_struct stats;
+	int length;
+
+	length = control(0xA1, HID_GET_REPORT, 0x0300, 0, sizeof(stats), NULL);
+	if (length != sizeof(stats)) {
+		printf("%6lu counters, %d bytes\n", frame, length);
+		return;
+	}
+	memcpy(&stats, control_in, sizeof(stats));
+	printf("%6lu counters: %u sent, %u frames waiting for a bank, %u waits on a full queue, %u retries, %u most queued\n",
+		frame, stats.sent, stats.bank_wait, stats.full_waits, stats.retries, stats.queue_high);
+	if (control(0x21, HID_SET_REPORT, 0x0300, 0, sizeof(stats), control_in) >= 0) {
+		printf("%6lu the counters can be written\n", frame);
+	}
+}
+
+int main(int argc, char **argv) {
+	int i;
+
+	memset(endpoint_interface, 0xFF, sizeof(endpoint_interface));
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "boot")) {
+			boot_protocol = 1;
+		} else if (!strcmp(argv[i], "reverse")) {
+			reverse_poll = 1;
+		} else if (!strncmp(argv[i], "reset=", 6) && (reset_count < MAX_EVENTS)) {
+			resets[reset_count++] = strtoul(argv[i] + 6, NULL, 10);
+		} else if (!strncmp(argv[i], "suspend=", 8) && strchr(argv[i], '+') && (suspend_count < MAX_EVENTS)) {
+			suspends[suspend_count] = strtoul(argv[i] + 8, NULL, 10);
+			suspend_frames[suspend_count++] = strtoul(strchr(argv[i], '+') + 1, NULL, 10);
+		} else {
+			fprintf(stderr, "Usage: %s [boot] [reverse] [reset=FRAME]... [suspend=FRAME+FRAMES]...\n", argv[0]);
+			return 1;
+		}
+	}
+
+	firmware_main();
+	printf("%6lu payload done\n", frame);
+	for (i = 0; i < DRAIN_FRAMES; i++) {
+		host_frame();
+	}
+	read_counters();
+	for (i = 0; i < interfaces && i < MAX_INTERFACES; i++) {
+		printf("%6lu interface %d: %lu reports\n", frame, i, host_reports[i]);
+	}
+	return 0;
+}
@@ -43,14 +43,60 @@
  * shell> ./main
  */
 
-// Define the Keyboard-Layout you want use
+// Define the Keyboard-Layout used at the start of the payload
 // See https://www.terena.org/activities/multiling/ml-mua/test/kbd-all.html
 // See http://home.datacomm.ch/t.bigler/sskbdsg.htm
-// For now: MAPPING_CH, MAPPING_DE, MAPPING_US (for all others)
-//#define MAPPING_US
-#define MAPPING_CH
-//#define MAPPING_DE
+// For now: LAYOUT_CH, LAYOUT_DE, LAYOUT_FR, LAYOUT_UK, LAYOUT_SE, LAYOUT_NO, LAYOUT_DK,
+// LAYOUT_US (for all others), new ones can be created with the layout_generator
+// All layouts are in the flash, the payload can switch with "M: US", "M: FR", ...
+//#define DEFAULT_LAYOUT LAYOUT_US
+#define DEFAULT_LAYOUT LAYOUT_CH
+//#define DEFAULT_LAYOUT LAYOUT_DE
+
+// Uncomment the next line to select the layout at boot with jumpers from PB0-PB3 to GND
+// The jumpers are read as a binary number: none: DEFAULT_LAYOUT, PB0: LAYOUT_US,
+// PB1: LAYOUT_CH, PB0 and PB1: LAYOUT_DE, PB2: LAYOUT_FR, PB0 and PB2: LAYOUT_UK,
+// PB1 and PB2: LAYOUT_SE, PB0-PB2: LAYOUT_NO, PB3: LAYOUT_DK
+//#define LAYOUT_JUMPER
+
+// With more than one script in PAYLOAD in the Makefile, each one is a slot and the slot
+// to execute is selected at boot, without a selection it is the first script (slot 0).
+// Uncomment the next line to select it with jumpers from PB4-PB7 to GND, read as a binary
+// number: none: slot 0, PB4: slot 1, PB5: slot 2, PB4 and PB5: slot 3, ... PB4-PB7: slot 15
+//#define PAYLOAD_JUMPER
+// Uncomment the next line to select it with the lock keys of the host, when it sets the LEDs
+// after the enumeration: Num Lock: slot 1, Caps Lock: slot 2, Scroll Lock: slot 4, added
+// together if more are on. Set STARTUP_READY to KEYBOARD_READY_LEDS then, so the payload
+// does not start before the host has set them. With PAYLOAD_JUMPER too a jumper wins.
+//#define PAYLOAD_LEDS
+
+// After the enumeration the payload starts as soon as the host has done one of the
+// STARTUP_READY things, see KEYBOARD_READY_* in usb_keyboard.h, but not before
+// STARTUP_MIN_WAIT and not later than STARTUP_MAX_WAIT milliseconds
+#define STARTUP_READY (KEYBOARD_READY_IDLE | KEYBOARD_READY_LEDS | KEYBOARD_READY_POLL)
+#define STARTUP_MIN_WAIT 50
+#define STARTUP_MAX_WAIT 3000
+
+// Uncomment the next line to let the host pause the payload by toggling Scroll Lock,
+// toggling it again continues. A script on the host can do this when it falls behind.
+//#define FLOW_CONTROL_LED KEYBOARD_LED_SCROLL_LOCK
+
+// Uncomment the next line to flash the LED each time the host has taken the given number of
+// reports, for PROGRESS_FLASH milliseconds. It stays on while the host takes no report for
+// STALL_FRAMES milliseconds although some are queued.
+//#define PROGRESS_LED 32
+#define PROGRESS_FLASH 20
+#define STALL_FRAMES 500
+
+// Uncomment the next line to reset the teensy when the firmware hangs for the given time,
+// the payload starts again at the beginning then
+//#define WATCHDOG WDTO_500MS
 
 // Uncomment the next line for debugging on a console and not using it on a teensy
 //#define CONSOLE_DEBUG
 
+// The slot executed on the console, "make trace TRACE_SLOT=2" selects another one
+#ifndef TRACE_SLOT
+#define TRACE_SLOT 0
+#endif
+
@@ -39,8 +39,12 @@
 
 /**
  * For debuging compile it like this:
+ * shell> make payload_data.h
  * shell> gcc -DCONSOLE_DEBUG keyboard_payload.c -o main
  * shell> ./main
+ * 
+ * Or with "make trace", which does the same. It prints every report which
+ * would be sent and at the end how many frames the payload needs.
  */
 
 /**
@@ -63,735 +67,1125 @@
 
 #include "config.h"
 #include "keyboard_payload.h"
+#include "bench.h"
+#include "tasks.h"
 
 #ifdef CONSOLE_DEBUG
 #include <stdio.h>
 #endif
 
+#ifdef BENCH_SIM
+#include "avr_mcu_section.h"
+
 /**
- * The string to send by the Keyboard.
- * @see parse_command_lines(char *str) for documentation
+ * Tells simavr which MCU to simulate and to write the debug pins
+ * from bench.h into bench.vcd, see "make bench-sim"
  */
-//char *str = "K: ALT F2\n\
-W 500\n\
-S konsole\n\
-E\n\
-W 1000\n\
-S echo '#!/bin/sh'>hacked.sh\n\
-E\n\
-S echo 'while :; do echo \"Hacked or so :))\";done'>>hacked.sh\n\
-E\n\
-S sh hacked.sh &\n\
-E\0";
+AVR_MCU(F_CPU, "atmega32u4");
+AVR_MCU_VCD_FILE("bench.vcd", 1000);
+const struct avr_mmcu_vcd_trace_t bench_trace[] _MMCU_ = {
+	{ AVR_MCU_VCD_SYMBOL("USB_GEN"), .mask = (1 << BENCH_PIN_USB_GEN), .what = (void *)&PORTD, },
+	{ AVR_MCU_VCD_SYMBOL("USB_COM"), .mask = (1 << BENCH_PIN_USB_COM), .what = (void *)&PORTD, },
+	{ AVR_MCU_VCD_SYMBOL("REPORT"), .mask = (1 << BENCH_PIN_REPORT), .what = (void *)&PORTD, },
+	{ AVR_MCU_VCD_SYMBOL("WAIT"), .mask = (1 << BENCH_PIN_WAIT), .what = (void *)&PORTD, },
+	{ AVR_MCU_VCD_SYMBOL("LOOKUP"), .mask = (1 << BENCH_PIN_LOOKUP), .what = (void *)&PORTD, },
+};
+#endif
 
-//char *str = "K ALT CTRL DEL\n\
-W 500\n\
-K ALT R\0";
+/**
+ * The compiled payload to send by the Keyboard.
+ * It is generated by payload_compiler out of payload.txt and stays in the
+ * flash, so the size of the payload is not limited by the RAM.
+ * With more scripts it holds one slot for each, payload_slots is where
+ * they start in payload.
+ * "make check" compiles the scripts in check/ into PAYLOAD_DATA instead.
+ * @see execute_payload(const uint8_t *code) for documentation
+ */
+#ifdef PAYLOAD_DATA
+#include PAYLOAD_DATA
+#else
+#include "payload_data.h"
+#endif
 
-char *str = "K WIN R\n\
-W 500\n\
-S PowerShell\n\
-E\n\
-W 1000\n\
-S (New-Object System.Net.WebClient).DownloadFile(\"http://ranta.ch/P1000269_small.JPG\", \"C:\\%USERPROFILE%\\hacked.jpg\"\n\
-E\0";
+/**
+ * Start of the payload and position of the next byte to read from it in the flash
+ */
+static const uint8_t *payload_start;
+static const uint8_t *payload_cursor;
+
+#ifdef PAYLOAD_COMPRESSED
+/**
+ * The payload_compiler -z has compressed the payload with LZSS: a flag byte
+ * for the next eight items, lowest bit first, a 1 for a literal byte and a
+ * 0 for a match of two bytes, the distance back into the last 256 bytes
+ * minus 1 and the length minus 3, for at most 255 bytes.
+ * The last 256 bytes read are kept in payload_ring for the matches, with
+ * the flags left of the flag byte above a 1 bit, the position in the ring
+ * and in the uncompressed payload, and the match being copied.
+ */
+static uint8_t payload_ring[256];
+static uint16_t payload_flags = 1;
+static uint8_t payload_ring_pos, payload_match, payload_match_length;
+static uint32_t payload_position;
 
 /**
- * Parse the line and check for the following commands:
- * -> K MODIFIER KEY
- * -> S STRING TO SEND
- * -> W 100
- * -> X
- * -> E
- * -> T
- * -> U
- * -> D
- * -> L
- * -> R
+ * Read the next byte from the payload, decompressed on the fly.
+ * Each byte costs only a few reads from the flash and the ring, far
+ * less than the millisecond the host takes for each report.
  * 
- * The "K" is used to simulate a KeyStroke with a modifier key
- *         Modifiers are A(lt), C(trl), W(in), S(hift), N(one)
- *         All keys after the modifier are sent in one keystroke
- *         To make the Modifier be pressed and after send each key by himself
- *         Special keys: CT(rl), AL(t), WI(n), SH(ift), DE(el), HO(me),
- *                       IN(sert), EN(d), ES(cape), SY(srq), EN(ter), TA(b)
- * The "S" is used to write a string
- * The "W" is used to wait the given amount of milliseconds before the next line is processed
- * The "X" sends an ESC keystroke
- * The "E" sends a RETURN keystroke
- * The "T" sends a TAB keystroke
- * The "U" sends a UP keystroke
- * The "D" sends a DOWN keystroke
- * The "L" sends a LEF keystroke
- * The "R" sends a RIGHT keystroke
+ * @return The byte at the position
+ */
+static uint8_t stream_read(void) {
+	uint8_t byte;
+
+	if (!payload_match_length) {
+		if (payload_flags == 1) {
+			payload_flags = 0x100 | pgm_read_byte(payload_cursor++);
+		}
+		if (payload_flags & 1) {
+			payload_flags >>= 1;
+			byte = pgm_read_byte(payload_cursor++);
+			payload_ring[payload_ring_pos++] = byte;
+			payload_position++;
+			return byte;
+		}
+		payload_flags >>= 1;
+		payload_match = payload_ring_pos - pgm_read_byte(payload_cursor++) - 1;
+		payload_match_length = pgm_read_byte(payload_cursor++) + 3;
+	}
+	// The match may overlap the bytes it writes, so it is copied one by one
+	byte = payload_ring[payload_match++];
+	payload_match_length--;
+	payload_ring[payload_ring_pos++] = byte;
+	payload_position++;
+	return byte;
+}
+
+/**
+ * Position in the uncompressed payload of the next byte to read
  * 
- * All spaces are removed between the command sequence and the first character
- * For better readability you can use an optional doublepoint after the command char
+ * @return The position
+ */
+static inline uint32_t payload_tell(void) {
+	return payload_position;
+}
+
+/**
+ * Continue reading the payload at the given position. There is no way
+ * into the middle of the compressed payload, so it is decompressed again
+ * from the start up to there.
  * 
- * @param *str Pointer to the CharArray to send
+ * @param position The position, see payload_tell()
  */
-void parse_command_lines(char *str);
+static void payload_seek(uint32_t position) {
+	payload_cursor = payload_start;
+	payload_flags = 1;
+	payload_ring_pos = 0;
+	payload_match_length = 0;
+	payload_position = 0;
+	while (payload_position < position) {
+		stream_read();
+	}
+}
+#else
+/**
+ * Read the next byte from the payload and move the cursor forward
+ * 
+ * @return The byte at the cursor
+ */
+static inline uint8_t stream_read(void) {
+	return pgm_read_byte(payload_cursor++);
+}
 
 /**
- * Keys to send as Keystrokes
+ * Position of the next byte to read from the payload
+ * 
+ * @return The position
  */
-int press_key = 0, press_modifier = 0;
+static inline uint32_t payload_tell(void) {
+	return payload_cursor - payload_start;
+}
 
 /**
- * Parse a single character, defined at the first position of an array of chars
- * and sets the global press_key and press_modifier.
+ * Continue reading the payload at the given position
  * 
- * @param *str Pointer to the CharArray to send
+ * @param position The position, see payload_tell()
+ */
+static inline void payload_seek(uint32_t position) {
+	payload_cursor = payload_start + position;
+}
+#endif
+
+/**
+ * The subroutines, repeated blocks and strings used more than once are in
+ * payload_pool, never compressed, so they can be read from any position.
+ * For each OP_CALL the stack keeps where its block starts, how often it
+ * has to be executed yet and where it returns to.
  */
-void parse_char(char *str);
+static const uint8_t *pool_cursor;
+static struct {
+	const uint8_t *start;
+	const uint8_t *back;
+	uint8_t count;
+} payload_stack[PAYLOAD_STACK_DEPTH];
+static uint8_t payload_depth;
 
 /**
- * Parse a special key, defined at the first and second position of an array of chars
- * and sets the global press_key and press_modifier.
+ * Read the next byte from the payload, or from the pool inside an OP_CALL
  * 
- * Special Keys are:
- *   Ctrl, Alt, Win, Shift, Del, Home, Insert, ENd, EScape, Sysrq, Return, Tab
+ * @return The byte
+ */
+static inline uint8_t payload_read(void) {
+	if (payload_depth) {
+		return pgm_read_byte(pool_cursor++);
+	}
+	return stream_read();
+}
+
+/**
+ * The active Keyboard-Layout, one of keyboard_layouts[] in the flash
+ */
+static const uint8_t (*keyboard_layout)[2];
+
+/**
+ * Switch the active Keyboard-Layout, this only swaps the keyboard_layout pointer
  * 
- * @param *str Pointer to the CharArray to send
- * @param modifier The current Modifier key to apply all others to
+ * @param layout One of the LAYOUT_* numbers
  */
-void parse_special(char *str, int *modifier);
+static inline void select_layout(uint8_t layout) {
+	if (layout < LAYOUT_COUNT) {
+		keyboard_layout = (const uint8_t (*)[2])pgm_read_word(&keyboard_layouts[layout]);
+	}
+}
 
+#ifdef CONSOLE_DEBUG
+/**
+ * Statistics of the report stream, printed at the end of the payload.
+ * The host polls the keyboard once each 1ms frame and takes one report.
+ */
+static unsigned long debug_chars, debug_reports, debug_frames, debug_wait;
+#endif
 
 /**
- * The main method
+ * The key and modifier in the last report sent by type_key() and the
+ * keyboard interface it was sent on, all other interfaces are released
  */
-int main(void) {
-	int i;
-	
+static uint8_t typed_key, typed_modifier, typed_interface;
+
 #ifndef CONSOLE_DEBUG
-	// Set for 16 MHz clock, configure the LED and turn it off
-	CPU_PRESCALE(0);
-	LED_CONFIG;
-	LED_OFF;
+#ifdef PROGRESS_LED
+/**
+ * Whether the host has taken no report for STALL_FRAMES frames although
+ * some are queued. A suspended bus is no stall.
+ * 
+ * @return 1 if the payload is stalled
+ */
+static uint8_t payload_stalled(void) {
+	static uint16_t sent, since;
 
-	// Initialize the USB, and then wait for the host to set configuration.
-	// If the Teensy is powered without a PC connected to the USB port,
-	// this will wait forever.
-	usb_init(); 
-	while (!usb_configured());
+	if ((usb_keyboard_sent() != sent) || !usb_keyboard_queue_depth() || usb_suspended()) {
+		sent = usb_keyboard_sent();
+		since = usb_frame_clock();
+		return 0;
+	}
+	return (uint16_t)(usb_frame_clock() - since) >= STALL_FRAMES;
+}
 
-	// Wait an extra second for the PC's operating system to load drivers
-	// and do whatever it does to actually be ready for input
-	// we just blink a little around in this time...
-	for (i = 0; i < 5; i++) {
+/**
+ * Flash the LED each PROGRESS_LED reports the host has taken, so it blinks
+ * faster the faster the payload is typed. It stays on while the payload is
+ * stalled, see payload_stalled().
+ */
+static struct task led_task;
+static void run_led_task(void) {
+	static uint16_t progress;
+
+	TASK_BEGIN(&led_task);
+	TASK_YIELD_UNTIL(&led_task, payload_start);
+	progress = usb_keyboard_sent();
+	while (1) {
+		TASK_YIELD_UNTIL(&led_task, ((uint16_t)(usb_keyboard_sent() - progress) >= PROGRESS_LED) || payload_stalled());
 		LED_ON;
-		_delay_ms(100);
+		if (payload_stalled()) {
+			TASK_YIELD_UNTIL(&led_task, !payload_stalled());
+		} else {
+			TASK_SLEEP(&led_task, PROGRESS_FLASH);
+		}
 		LED_OFF;
-		_delay_ms(100);
+		progress = usb_keyboard_sent();
 	}
-#endif
-	
-	// Parse the above defined command
-	parse_command_lines(str);
-	return 0;
+	TASK_END(&led_task);
 }
+#endif
 
+#ifdef WATCHDOG
 /**
- * Implementatio of parse_line (char *str)
+ * Reset the watchdog each time the payload sleeps, so it only resets the
+ * teensy if the payload runs for WATCHDOG without sleeping. While the bus
+ * is suspended the payload sleeps until the resume, the watchdog is off then.
  */
-void parse_command_lines(char *str) {
-	char *send = str, chr;
-	int cmd = *(send++), timeout = 0, current_key_pos = 0, current_modifier = 0;;
-#ifdef CONSOLE_DEBUG
-	// This is defined in usb_keyboard.c (as an array of int) which we not include in CONSOLE_DEBUG mode
-	char keyboard_keys[6] = { 0, 0, 0, 0, 0, 0 };
-#endif
-	
-	// Skip the ":" after the command
-	if (*send == ':') {
-		send++;
-	}
-	
-	// Skip all whitespaces if there are some
-	if (*send == ' ') {
-		while (*send == ' ') {
-			send++;
+static struct task watchdog_task;
+static void run_watchdog_task(void) {
+	TASK_BEGIN(&watchdog_task);
+	TASK_YIELD_UNTIL(&watchdog_task, payload_start);
+	while (1) {
+		wdt_enable(WATCHDOG);
+		while (!usb_suspended()) {
+			wdt_reset();
+			TASK_YIELD(&watchdog_task);
 		}
+		wdt_disable();
+		TASK_YIELD_UNTIL(&watchdog_task, !usb_suspended());
 	}
-	
-#ifdef CONSOLE_DEBUG
-	int debug_char;
+	TASK_END(&watchdog_task);
+}
 #endif
-	
-	// Check for the command
-	switch (cmd) {
-		// Single key with a modifier
-		case 'K':
-		case 'k':
-#ifdef CONSOLE_DEBUG
-			debug_char = *send;
-			printf("> Keystroke with modifier: %s and keys:", &debug_char);
-#endif
-			// When stroking more than a modifier and one key, this holds the position of the current pos in keyboard_keys[6] from usb_keyboard.c
-			current_key_pos = 0;
-			keyboard_keys[0] = 0;
-			keyboard_keys[1] = 0;
-			keyboard_keys[2] = 0;
-			keyboard_keys[3] = 0;
-			keyboard_keys[4] = 0;
-			keyboard_keys[5] = 0;
-			
-			// Get the main Modifier, all others are applied by an &
-			switch (*send) {
-				case 'W':
-				case 'w':
-					current_modifier = KEY_GUI;
-					break;
-				case 'S':
-				case 's':
-					current_modifier = KEY_SHIFT;
-					break;
-				case 'C':
-				case 'c':
-					current_modifier = KEY_CTRL;
-					break;
-				case 'A':
-				case 'a':
-					current_modifier = KEY_ALT;
-					break;
-				default:
-					current_modifier = KEY_NONE;
-			}
 
-			while (1) {
-				chr = *(send++);
-				if (chr == '\0') break;
-				if (chr == '\r') continue;
-				if (chr == '\n') break;
-				if (current_key_pos >= 6) continue;
-				if (chr == ' ') {
-#ifdef CONSOLE_DEBUG
-					// For debug we need the real character, for the USB-Keyboard we first parse it (see below)
-					keyboard_keys[current_key_pos] = *send;
-#endif
-					
-					// Check for F1-F12 or parse a normal key
-					if ( ((*send == 'f') || (*send == 'F'))
-						&& ((*(send + 1) > 48) && (*(send + 1) < 58)) // Check ASCII-Code gt 0 and le 9
-					) {
-						send++;
-#ifdef CONSOLE_DEBUG
-						debug_char = *send;
-						printf(" F%s", &debug_char);
-#endif
-						
-						// Check for F10-12
-						if (((*(send + 1) > 47) && (*(send + 1) < 51))) {
-							send++;
-							press_key = 19 + *send; // USB-Scankey for F10-F12 is 67-69
-						} else {
-							press_key = 9 + *send; // USB-Scankey for F1-F9 is 58-66
-						}
-						
-					// Special command key made of at least 2 chars
-					} else if (*(send + 1) > 32) {
-						parse_special(send++, &current_modifier);
-#ifdef CONSOLE_DEBUG
-						debug_char = *(send - 1);
-						printf(" +%s", &debug_char);
-#endif
-						
-					// Any other key
-					} else {
-						parse_char(send++);
-#ifdef CONSOLE_DEBUG
-						debug_char = *(send - 1);
-						printf(" %s", &debug_char);
-#endif
-					}
-					
-					// Set the parsed key directly in the usb_keyboard variable keyboard_keys[6]
-					if (press_key != KEY_NONE) {
-#ifndef CONSOLE_DEBUG
-						keyboard_keys[current_key_pos] = press_key;
-#endif
-						current_key_pos++;
-					}
-				}
-				
-				// Go forward to the next space
-				while (*send > 32) {
-					send++;
-				}
-			}
-#ifdef CONSOLE_DEBUG
-			printf("\n");
-#else
-			// The same way usb_keyboard_press() is doing but not with one key but with all we where reading out before
-			int8_t r;
-			keyboard_modifier_keys = current_modifier;
-			r = usb_keyboard_send();
-			if (!r) {
-				keyboard_modifier_keys = 0;
-				keyboard_keys[0] = 0;
-				keyboard_keys[1] = 0;
-				keyboard_keys[2] = 0;
-				keyboard_keys[3] = 0;
-				keyboard_keys[4] = 0;
-				keyboard_keys[5] = 0;
-				r = usb_keyboard_send();
-			}
-#endif
-			break;
-			
-		// Send a String and press ENTER at the end
-		case 'S':
-		case 's':
-			while (1) {
-				chr = *(send++);
-				if (chr == '\0') break;
-				if (chr == '\r') continue;
-				if (chr == '\n') break;
-				parse_char(&chr);
-#ifdef CONSOLE_DEBUG
-				cmd = 0; // If I not do this, printf shows 'S' after the parsed character... Don't know yet why
-				printf("  Char: %s, ASCII: %d, USB: %d, Modifier: %d\n", &chr, chr, press_key, press_modifier);
-#else
-				usb_keyboard_press(press_key, press_modifier);
-#endif
-			}
-			break;
-			
-		// Wait for the given amount of milliseconds
-		case 'W':
-		case 'w':
-			timeout = 0;
-			while (1) {
-				chr = *(send++);
-				if (chr == '\0') break;
-				if (chr == '\r') continue;
-				if (chr == '\n') break;
-				if (chr > 47 && chr < 58) {
-					timeout *= 10;
-					timeout += (chr - 48);
-				}
-			}
-#ifdef CONSOLE_DEBUG
-			printf("> Waiting for %d Milliseconds\n", timeout);
-#else
-			// The _delay_ms function needs a compile-time constant, so we count up in 10ms steps until we reach timeout
-			while (timeout > 10) {
-				timeout -= 10;
-				_delay_ms(10);
-			}
-#endif
-			break;
-			
-		case 'X':
-		case 'x':
-			// Read until the end of the line and press the ESCAPE key
-			chr = *send;
-			while (1) {
-				if (chr == '\0') break;
-				if (chr == '\n') break;
-				chr = *(send++);
-			}
-#ifdef CONSOLE_DEBUG
-			printf("> sending ESCAPE\n");
-#else
-			usb_keyboard_press(KEY_ESC, KEY_NONE);
-#endif
-			break;
-			
-		case 'E':
-		case 'e':
-			// Read until the end of the line and press the RETURN key
-			chr = *send;
-			while (1) {
-				if (chr == '\0') break;
-				if (chr == '\n') break;
-				chr = *(send++);
-			}
-#ifdef CONSOLE_DEBUG
-			printf("> sending ENTER\n");
-#else
-			usb_keyboard_press(KEY_ENTER, KEY_NONE);
+/**
+ * Run all tasks until they yield, see tasks.h. They start with the payload.
+ */
+static inline void run_tasks(void) {
+#ifdef PROGRESS_LED
+	run_led_task();
 #endif
-			break;
-			
-		case 'T':
-		case 't':
-			// Read until the end of the line and press the TABULATOR key
-			chr = *send;
-			while (1) {
-				if (chr == '\0') break;
-				if (chr == '\n') break;
-				chr = *(send++);
-			}
-#ifdef CONSOLE_DEBUG
-			printf("> sending TAB\n");
-#else
-			usb_keyboard_press(KEY_TAB, KEY_NONE);
+#ifdef WATCHDOG
+	run_watchdog_task();
 #endif
-			break;
-			
-		case 'U':
-		case 'u':
-			// Read until the end of the line and press the TABULATOR key
-			chr = *send;
-			while (1) {
-				if (chr == '\0') break;
-				if (chr == '\n') break;
-				chr = *(send++);
+}
+
+/**
+ * Sleep until the next interrupt, at the latest the next frame.
+ * Must be called with the interrupts disabled, after checking the condition
+ * to wait for, so no interrupt can get lost in between. The interrupts
+ * are enabled again when it returns.
+ * The tasks run before, still with the interrupts disabled.
+ */
+static void payload_sleep(void) {
+	run_tasks();
+
+	// While the bus is suspended only the USB wakeup interrupt comes
+	if (usb_suspended()) {
+		set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+	} else {
+		set_sleep_mode(SLEEP_MODE_IDLE);
+	}
+	sleep_enable();
+	sei();
+	sleep_cpu();
+	sleep_disable();
+}
+
+/**
+ * Sleep as long as the host has suspended the bus
+ */
+static void wait_resumed(void) {
+	cli();
+	while (usb_configured() && usb_suspended()) {
+		payload_sleep();
+		cli();
+	}
+	sei();
+}
+
+/**
+ * Sleep for the given number of frames, without waiting for the queue
+ * 
+ * @param frames Milliseconds to sleep
+ */
+static void sleep_frames(uint16_t frames) {
+	uint16_t start;
+
+	start = usb_frame_clock();
+	cli();
+	while (usb_configured() && ((uint16_t)(usb_frame_clock() - start) < frames)) {
+		payload_sleep();
+		cli();
+	}
+	sei();
+}
+
+/**
+ * The frame the script's timeline is at: each OP_WAIT moves it on by its
+ * milliseconds and sleeps until it, so the time spent sending the reports
+ * before is part of the wait and does not add up over the script. Where
+ * the payload waits for the host it starts again at the current frame,
+ * see sync_deadline().
+ */
+static uint16_t payload_deadline;
+
+/**
+ * Start the script's timeline again at the current frame: at the start,
+ * after the host has answered a OP_SYNC or OP_CALIBRATE, after a pause
+ * by the host and after a bus reset
+ */
+static inline void sync_deadline(void) {
+	payload_deadline = usb_frame_clock();
+}
+
+/**
+ * Keep the deadline at most WAIT_RANGE frames behind the frame clock,
+ * however long the payload types without a wait
+ */
+static inline void limit_deadline(void) {
+	if ((int16_t)(usb_frame_clock() - payload_deadline) > WAIT_RANGE) {
+		payload_deadline = usb_frame_clock() - WAIT_RANGE;
+	}
+}
+
+/**
+ * The bus resets seen when the payload started or continued at the last
+ * checkpoint, and the reports queued since
+ */
+static uint8_t payload_resets;
+static uint16_t payload_reports;
+
+/**
+ * Queue the report in keyboard_key_bitmap and keyboard_modifier_keys.
+ * While the queue is full it sleeps until the next interrupt and tries
+ * again. If it stays full for RETRY_TIMEOUT frames, it is sent again after
+ * a pause which gets twice as long each time. While the host has paused
+ * us with the FLOW_CONTROL_LED it sleeps as long as the host wants, the
+ * script's timeline starts again after the pause. While the bus is
+ * suspended it waits for the resume. After a bus reset nothing is sent
+ * anymore, execute_payload() continues at the last checkpoint then.
+ * 
+ * @param flags The keyboard interface and KEYBOARD_SAME_FRAME, see usb_keyboard_send_on()
+ */
+static void queue_report(uint8_t flags) {
+	uint8_t backoff = RETRY_BACKOFF, paused = 0;
+	uint16_t start;
+	int8_t full;
+
+	start = usb_frame_clock();
+	while (usb_resets() == payload_resets) {
+		cli();
+		full = usb_keyboard_send_on(flags);
+		if (!full) {
+			sei();
+			payload_reports++;
+			if (paused) {
+				sync_deadline();
+			} else {
+				limit_deadline();
 			}
-#ifdef CONSOLE_DEBUG
-			printf("> sending UP\n");
-#else
-			usb_keyboard_press(KEY_UP, KEY_NONE);
-#endif
-			break;
-			
-		case 'D':
-		case 'd':
-			// Read until the end of the line and press the TABULATOR key
-			chr = *send;
-			while (1) {
-				if (chr == '\0') break;
-				if (chr == '\n') break;
-				chr = *(send++);
+			return;
+		}
+		if (full < 0) {
+			sei();
+			if (!usb_configured()) {
+				return;
 			}
-#ifdef CONSOLE_DEBUG
-			printf("> sending DOWN\n");
-#else
-			usb_keyboard_press(KEY_DOWN, KEY_NONE);
-#endif
-			break;
-			
-		case 'L':
-		case 'l':
-			// Read until the end of the line and press the TABULATOR key
-			chr = *send;
-			while (1) {
-				if (chr == '\0') break;
-				if (chr == '\n') break;
-				chr = *(send++);
+			wait_resumed();
+			start = usb_frame_clock();
+		} else if (usb_keyboard_paused()) {
+			paused = 1;
+			start = usb_frame_clock();
+			payload_sleep();
+		} else if ((uint16_t)(usb_frame_clock() - start) >= RETRY_TIMEOUT) {
+			sei();
+			usb_keyboard_count_retry();
+			sleep_frames(backoff);
+			if (backoff < RETRY_BACKOFF_MAX) {
+				backoff <<= 1;
 			}
-#ifdef CONSOLE_DEBUG
-			printf("> sending LEFT\n");
-#else
-			usb_keyboard_press(KEY_LEFT, KEY_NONE);
+			start = usb_frame_clock();
+		} else {
+			BENCH_ON(BENCH_PIN_WAIT);
+			payload_sleep();
+			BENCH_OFF(BENCH_PIN_WAIT);
+		}
+	}
+}
 #endif
-			break;
-			
-		case 'R':
-		case 'r':
-			// Read until the end of the line and press the TABULATOR key
-			chr = *send;
-			while (1) {
-				if (chr == '\0') break;
-				if (chr == '\n') break;
-				chr = *(send++);
-			}
+
+/**
+ * Send a report with only the given key and modifier pressed
+ * 
+ * @param key The USB-Keyboard Scancode or KEY_NONE
+ * @param modifier The modifier keys
+ * @param flags The keyboard interface and KEYBOARD_SAME_FRAME, see usb_keyboard_send_on()
+ */
+static void send_report(uint8_t key, uint8_t modifier, uint8_t flags) {
+	typed_key = key;
+	typed_modifier = modifier;
+	typed_interface = flags & KEYBOARD_INTERFACE_MASK;
 #ifdef CONSOLE_DEBUG
-			printf("> sending RIGHT\n");
+	printf("    Report: USB: %d, Modifier: %d, Interface: %d%s\n", key, modifier, typed_interface, (flags & KEYBOARD_SAME_FRAME) ? ", same frame" : "");
+	debug_reports++;
+	if (!(flags & KEYBOARD_SAME_FRAME)) {
+		debug_frames++;
+	}
 #else
-			usb_keyboard_press(KEY_RIGHT, KEY_NONE);
+	usb_keyboard_release_all();
+	keyboard_modifier_keys = modifier;
+	usb_keyboard_key_down(key);
+	queue_report(flags);
 #endif
-			break;
+}
+
+/**
+ * Type a key with as few reports as possible: the report goes directly
+ * from the last key to the next one, a release is only sent in between
+ * if the same key is typed again or the modifier changes.
+ * So "hello" needs seven reports and not ten.
+ * 
+ * @param key The USB-Keyboard Scancode
+ * @param modifier The modifier keys
+ */
+static void type_key(uint8_t key, uint8_t modifier) {
+#if (KEYBOARD_INTERFACES > 1) && defined(SAME_FRAME_REPEAT)
+	// The same key again is pressed on the other keyboard while the first one
+	// releases it, both in the same frame. Not with a modifier, the host merges
+	// them from all keyboards and the order in the frame is not defined.
+	// Neither is the order of the keys, a host which takes the press before the
+	// release sees the key only once, so it is off unless measured on the host.
+	if ((key == typed_key) && (modifier == KEY_NONE) && (typed_modifier == KEY_NONE)) {
+		send_report(KEY_NONE, KEY_NONE, typed_interface);
+		send_report(key, modifier, (typed_interface ^ 1) | KEYBOARD_SAME_FRAME);
+		return;
 	}
-	
-	// Recursive call until the string ends with a '0'
-	if (*send != 0) {
-		parse_command_lines(send);
+#endif
+	if ((key == typed_key) || (modifier != typed_modifier)) {
+		send_report(KEY_NONE, modifier, typed_interface);
 	}
-	#ifdef CONSOLE_DEBUG
-	else {
-		printf("> End\n");
+	send_report(key, modifier, typed_interface);
+}
+
+/**
+ * Release the key and modifier pressed by type_key()
+ */
+static void type_release(void) {
+	if ((typed_key != KEY_NONE) || (typed_modifier != KEY_NONE)) {
+		send_report(KEY_NONE, KEY_NONE, typed_interface);
 	}
-	#endif
 }
 
+#ifndef CONSOLE_DEBUG
 /**
- * Implementation of parse_char(char *str)
+ * Sleep until all queued reports are sent to the host
  */
-void parse_char(char *str) {
-	int chr = *str;
-	
-	// Default values
-	press_modifier = KEY_NONE;
-	
-	// Chars: ENTER, SPACE
-	if (chr == 10) {
-		press_key = KEY_ENTER;
+static void wait_sent(void) {
+	cli();
+	while (usb_configured() && usb_keyboard_queue_depth()) {
+		payload_sleep();
+		cli();
 	}
-	else if (chr == 32) {
-		press_key = KEY_SPACE;
+	sei();
+}
+
+/**
+ * Sleep until the host has taken all reports queued by the payload, or
+ * until a bus reset has dropped the rest
+ *
+ * @return 1 after a bus reset
+ */
+static uint8_t wait_taken(void) {
+	cli();
+	while ((usb_resets() == payload_resets) && ((int16_t)(usb_keyboard_taken() - payload_reports) < 0)) {
+		payload_sleep();
+		cli();
 	}
-	
-	// Chars: {|}~
-	else if (chr > 122) {
-		switch (chr) {
-			case '{':
-				press_key = SKEY_LEFT_CURLYBRACE;
-				press_modifier = SMOD_LEFT_CURLYBRACE;
-				break;
-				
-			case '}':
-				press_key = SKEY_RIGHT_CURLYBRACE;
-				press_modifier = SMOD_RIGHT_CURLYBRACE;
-				break;
-				
-			case '|':
-				press_key = SKEY_TILDE;
-				press_modifier = SMOD_TILDE;
-				break;
-				
-			case '~':
-				press_key = SKEY_PIPE;
-				press_modifier = SMOD_PIPE;
-				break;
+	sei();
+	return usb_resets() != payload_resets;
+}
+
+/**
+ * Move the deadline on by the given milliseconds and sleep until the frame
+ * clock is there, the queued reports are sent meanwhile. If sending the
+ * reports since the last wait took longer, it does not wait at all.
+ * The frame clock stands still while the bus is suspended.
+ * 
+ * @param timeout Milliseconds to wait
+ */
+static void wait_frames(uint16_t timeout) {
+	uint16_t step;
+
+	limit_deadline();
+	do {
+		step = (timeout > WAIT_RANGE) ? WAIT_RANGE : timeout;
+		timeout -= step;
+		payload_deadline += step;
+		cli();
+		while (usb_configured() && ((int16_t)(usb_frame_clock() - payload_deadline) < 0)) {
+			payload_sleep();
+			cli();
 		}
+		sei();
+	} while (timeout);
+}
+
+/**
+ * Sleep until the host's driver is ready for the keystrokes, this is
+ * when it has done one of the STARTUP_READY things after the enumeration.
+ * The LED is on while waiting, so the time can be measured on its pin.
+ * 
+ * @param min Milliseconds to wait at least
+ * @param max Milliseconds to wait at most
+ */
+static void wait_ready(uint16_t min, uint16_t max) {
+	uint16_t start, waited;
+
+	LED_ON;
+	start = usb_frame_clock();
+	cli();
+	while (usb_configured()) {
+		waited = usb_frame_clock() - start;
+		if (waited >= max || (waited >= min && (usb_keyboard_ready() & STARTUP_READY))) {
+			break;
+		}
+		payload_sleep();
+		cli();
 	}
-	
-	// chars: a-z
-	// the small 'a' is at position '4' for usb-keycodes
-	else if (chr > 96) {
-		press_key = chr - (97 - 4);
+	sei();
+	LED_OFF;
+}
+
+/**
+ * Sleep until the host has switched the LED or the timeout is over
+ * 
+ * @param led The KEYBOARD_LED_* to wait for
+ * @param state The state of the LED to wait for
+ * @param timeout Milliseconds to wait at most
+ * @return 1 if the LED is in the state, 0 after the timeout
+ */
+static uint8_t wait_led(uint8_t led, uint8_t state, uint16_t timeout) {
+	uint16_t start;
+
+	wait_sent();
+	start = usb_frame_clock();
+	cli();
+	while (usb_configured() && ((keyboard_leds & led) != state) && ((uint16_t)(usb_frame_clock() - start) < timeout)) {
+		payload_sleep();
+		cli();
 	}
-	
-	// chars: [\]^_`
-	else if (chr > 90) {
-		switch (chr) {
-			case '[':
-				press_key = SKEY_LEFT_SQUAREBRACE;
-				press_modifier = SMOD_LEFT_SQUAREBRACE;
-				break;
-				
-			case ']':
-				press_key = SKEY_RIGHT_SQUAREBRACE;
-				press_modifier = SMOD_RIGHT_SQUAREBRACE;
-				break;
-				
-			case '\\':
-				press_key = SKEY_BACKSLASH;
-				press_modifier = SMOD_BACKSLASH;
-				break;
-				
-			case '^':
-				press_key = SKEY_ROOF;
-				press_modifier = SMOD_ROOF;
-				break;
-				
-			case '_':
-				press_key = SKEY_UNDERLINE;
-				press_modifier = SMOD_UNDERLINE;
-				break;
-				
-			case '`':
-				press_key = SKEY_BACKQUOTE;
-				press_modifier = SMOD_BACKQUOTE;
-				break;
+	sei();
+	return (keyboard_leds & led) == state;
+}
+
+/**
+ * Find the smallest gap between the reports the host can handle without
+ * losing keystrokes and use it for the rest of the payload. For each gap,
+ * starting with the slowest, a burst of Num Lock toggles is sent and the
+ * host has to switch the LED for each of them.
+ * 
+ * @param timeout Milliseconds to wait for the LED after each burst
+ */
+static void calibrate(uint16_t timeout) {
+	uint8_t gap, good = CALIBRATE_SLOWEST, leds, changes, i;
+	uint16_t start;
+
+	for (gap = CALIBRATE_SLOWEST; ; gap >>= 1) {
+		usb_keyboard_set_gap(gap);
+		leds = keyboard_leds & KEYBOARD_LED_NUM_LOCK;
+		changes = usb_keyboard_led_changes();
+		for (i = 0; i < CALIBRATE_BURST; i++) {
+			type_key(KEY_NUM_LOCK, KEY_NONE);
+			type_release();
+		}
+		wait_sent();
+		start = usb_frame_clock();
+		cli();
+		while (usb_configured() && ((uint8_t)(usb_keyboard_led_changes() - changes) < CALIBRATE_BURST) && ((uint16_t)(usb_frame_clock() - start) < timeout)) {
+			payload_sleep();
+			cli();
+		}
+		sei();
+		changes = usb_keyboard_led_changes() - changes;
+
+		// A lost toggle leaves the Num Lock inverted, switch it back slowly
+		if ((keyboard_leds & KEYBOARD_LED_NUM_LOCK) != leds) {
+			usb_keyboard_set_gap(good);
+			type_key(KEY_NUM_LOCK, KEY_NONE);
+			type_release();
+			wait_led(KEYBOARD_LED_NUM_LOCK, leds, timeout);
+		}
+		if (changes < CALIBRATE_BURST) {
+			break;
+		}
+		good = gap;
+		if (gap == 0) {
+			break;
 		}
 	}
-	
-	// chars: A-Z
-	// the small 'a' is at position '4' for usb-keycodes
-	else if (chr > 64) {
-		press_key = chr - (65 - 4);
-		press_modifier = KEY_SHIFT;
+	usb_keyboard_set_gap(good);
+}
+
+/**
+ * Where the payload continues after a bus reset, with the layout active
+ * there: the start of the last line the host has taken all reports of,
+ * or the last OP_CHECKPOINT
+ */
+static uint32_t checkpoint;
+static const uint8_t (*checkpoint_layout)[2];
+
+/**
+ * The starts of the lines, or an OP_CHECKPOINT, which become the checkpoint
+ * as soon as the host has taken the reports queued before them, the oldest
+ * first
+ */
+static struct {
+	uint32_t position;
+	const uint8_t (*layout)[2];
+	uint16_t reports;
+} checkpoint_next[CHECKPOINT_LINES];
+static uint8_t checkpoint_next_count;
+
+/**
+ * Set with the first OP_CHECKPOINT, the ends of the lines do not move it anymore
+ */
+static uint8_t checkpoint_marked;
+
+/**
+ * Queue the current position as the next checkpoint once the host has taken
+ * all reports queued up to here. If the queue of them is full, it replaces
+ * the newest one, which only waits for fewer reports.
+ */
+static void queue_checkpoint(void) {
+	if (checkpoint_next_count == CHECKPOINT_LINES) {
+		checkpoint_next_count--;
 	}
-	
-	// chars: :;<=>?@
-	else if (chr > 57) {
-		switch (chr) {
-			case ':':
-				press_key = SKEY_DOUBLEPOINT;
-				press_modifier = SMOD_DOUBLEPOINT;
-				break;
-				
-			case ';':
-				press_key = SKEY_SEMICOLON;
-				press_modifier = SMOD_SEMICOLON;
-				break;
-				
-			case '<':
-				press_key = SKEY_SMALLERTHAN;
-				press_modifier = SMOD_SMALLERTHAN;
-				break;
-				
-			case '>':
-				press_key = SKEY_GREATERTHAN;
-				press_modifier = SMOD_GREATERTHAN;
-				break;
-				
-			case '=':
-				press_key = SKEY_EQUAL;
-				press_modifier = SMOD_EQUAL;
-				break;
-				
-			case '?':
-				press_key = SKEY_QUESTION;
-				press_modifier = SMOD_QUESTION;
-				break;
-				
-			case '@':
-				press_key = SKEY_AT;
-				press_modifier = SMOD_AT;
-				break;
-		}
+	checkpoint_next[checkpoint_next_count].position = payload_tell();
+	checkpoint_next[checkpoint_next_count].layout = keyboard_layout;
+	checkpoint_next[checkpoint_next_count].reports = payload_reports;
+	checkpoint_next_count++;
+}
+
+/**
+ * Make the newest of the queued positions the checkpoint whose reports
+ * the host has taken, and drop the older ones
+ *
+ * @param taken The reports the host has taken, see usb_keyboard_taken()
+ */
+static void promote_checkpoint(uint16_t taken) {
+	uint8_t i, n = 0;
+
+	while ((n < checkpoint_next_count) && ((int16_t)(taken - checkpoint_next[n].reports) >= 0)) {
+		n++;
 	}
-	
-	// chars: 0
-	// the '0' is at position '39' for usb-keycodes
-	else if (chr == 48) {
-		press_key = KEY_0;
+	if (!n) {
+		return;
 	}
+	checkpoint = checkpoint_next[n - 1].position;
+	checkpoint_layout = checkpoint_next[n - 1].layout;
+	checkpoint_next_count -= n;
+	for (i = 0; i < checkpoint_next_count; i++) {
+		checkpoint_next[i] = checkpoint_next[i + n];
+	}
+}
+
+/**
+ * Wait until the host has configured us again after a bus reset and its
+ * driver is ready, then continue the payload at the checkpoint
+ */
+static void resume_checkpoint(void) {
+	do {
+		payload_resets = usb_resets();
+		cli();
+		while (!usb_configured()) {
+			payload_sleep();
+			cli();
+		}
+		sei();
+		wait_ready(STARTUP_MIN_WAIT, STARTUP_MAX_WAIT);
+	} while (payload_resets != usb_resets());
 	
-	// chars: 1-9
-	// the '1' is at position '30' for usb-keycodes
-	else if (chr > 48) {
-		press_key = chr - (49 - 30);
+	// The reset has emptied the queue, the host has released all keys
+	payload_reports = usb_keyboard_sent();
+	payload_seek(checkpoint);
+	payload_depth = 0;
+	sync_deadline();
+	keyboard_layout = checkpoint_layout;
+	checkpoint_next_count = 0;
+	typed_key = KEY_NONE;
+	typed_modifier = KEY_NONE;
+	typed_interface = 0;
+}
+#endif
+
+#if defined(LAYOUT_JUMPER) || (defined(PAYLOAD_JUMPER) && !defined(CONSOLE_DEBUG))
+/**
+ * Read the jumpers on the given pins of port B, see config.h
+ * 
+ * @param mask The pins to read
+ * @return The masked pins, set for each jumper to GND
+ */
+static uint8_t read_jumpers(uint8_t mask) {
+	// Inputs with the pull-up resistors on, a jumper pulls the pin to GND
+	DDRB &= ~mask;
+	PORTB |= mask;
+	_delay_ms(1);
+	return ~PINB & mask;
+}
+#endif
+
+#ifdef LAYOUT_JUMPER
+/**
+ * Read the layout from the jumpers on PB0-PB3, see config.h
+ * 
+ * @return The LAYOUT_* number or DEFAULT_LAYOUT without a jumper
+ */
+static uint8_t read_layout_jumper(void) {
+	uint8_t jumper = read_jumpers(0x0F);
+
+	return (jumper && (jumper <= LAYOUT_COUNT)) ? (jumper - 1) : DEFAULT_LAYOUT;
+}
+#endif
+
+/**
+ * Select the slot of the payload to execute with the PAYLOAD_JUMPER on
+ * PB4-PB7 or the PAYLOAD_LEDS the host has set, see config.h. It is only
+ * a lookup in payload_slots, a slot which does not exist is slot 0.
+ * 
+ * @return Pointer to the bytecode of the slot
+ */
+static const uint8_t *select_slot(void) {
+	uint8_t slot = 0;
+
+#ifdef CONSOLE_DEBUG
+	slot = TRACE_SLOT;
+#else
+#ifdef PAYLOAD_JUMPER
+	slot = read_jumpers(0xF0) >> 4;
+#endif
+#ifdef PAYLOAD_LEDS
+	if (!slot) {
+		slot = keyboard_leds & (KEYBOARD_LED_NUM_LOCK | KEYBOARD_LED_CAPS_LOCK | KEYBOARD_LED_SCROLL_LOCK);
+	}
+#endif
+#endif
+	if (slot >= PAYLOAD_SLOTS) {
+		slot = 0;
+	}
+	return payload + pgm_read_word(&payload_slots[slot]);
+}
+
+/**
+ * Execute the bytecode created by payload_compiler.c:
+ * -> OP_CHORD MODIFIER COUNT KEY...
+ * -> OP_TYPE COUNT CHARACTER...
+ * -> OP_REPORTS COUNT CHARACTERS (MODIFIER KEY)...
+ * -> OP_WAIT LOW HIGH
+ * -> OP_LAYOUT LAYOUT
+ * -> OP_SYNC KEY LED LOW HIGH
+ * -> OP_CALIBRATE LOW HIGH
+ * -> OP_CHECKPOINT
+ * -> OP_CALL LOW HIGH COUNT
+ * -> OP_RETURN
+ * -> OP_EOL
+ * -> OP_END
+ * 
+ * The "OP_CHORD" presses all keys together with the modifier and releases them
+ * The "OP_TYPE" presses and releases the key for each character after each other,
+ *              the key and modifier are looked up in the active keyboard_layout
+ * The "OP_REPORTS" sends the reports rendered by payload_compiler -r as they are,
+ *              the characters they type are only counted for the statistics
+ * The "OP_WAIT" waits the given amount of milliseconds
+ * The "OP_LAYOUT" switches the active keyboard_layout
+ * The "OP_SYNC" presses the lock key and waits until the host switches its LED,
+ *              then the same again to restore it, each time for the given
+ *              milliseconds at most
+ * The "OP_CALIBRATE" finds the fastest typing speed the host can handle, see calibrate()
+ * The "OP_CALL" executes the block at the address in payload_pool COUNT times
+ * The "OP_RETURN" ends a block in payload_pool
+ * The "OP_CHECKPOINT" waits until the host has taken all reports, after a bus
+ *              reset the payload continues here and not at the last line
+ * The "OP_EOL" marks the end of a line in the script, after a bus reset the
+ *              payload continues at the last line the host has taken completely
+ * The "OP_END" marks the end of the payload
+ * 
+ * All parsing was already done by the payload_compiler, so this only has to
+ * fetch the next opcode and send the keys.
+ * The bytecode is read byte by byte out of the flash in one loop, so neither
+ * RAM nor stack usage grow with the size of the payload.
+ * 
+ * @param *code Pointer to the bytecode in the flash to execute
+ */
+void execute_payload(const uint8_t *code);
+
+
+/**
+ * The main method
+ */
+int main(void) {
+#ifndef CONSOLE_DEBUG
+#ifdef WATCHDOG
+	// After a reset by the watchdog it is still on, run_watchdog_task() enables it
+	MCUSR &= ~(1 << WDRF);
+	wdt_disable();
+#endif
+	// Set for 16 MHz clock, configure the LED and turn it off
+	CPU_PRESCALE(0);
+	LED_CONFIG;
+	LED_OFF;
+	BENCH_INIT();
+
+	// Initialize the USB, and then wait for the host to set configuration.
+	// If the Teensy is powered without a PC connected to the USB port,
+	// this will sleep forever.
+	// simavr has no USB controller, the PLL would never lock there, and
+	// without the configuration all waits return at once.
+#ifndef BENCH_SIM
+	usb_init(); 
+#endif
+#ifdef LAYOUT_JUMPER
+	select_layout(read_layout_jumper());
+#else
+	select_layout(DEFAULT_LAYOUT);
+#endif
+#ifndef BENCH_SIM
+	cli();
+	while (!usb_configured()) {
+		payload_sleep();
+		cli();
 	}
+	sei();
+
+	// Wait for the PC's operating system to load the drivers and to
+	// actually be ready for input, the LED is on in this time
+	wait_ready(STARTUP_MIN_WAIT, STARTUP_MAX_WAIT);
+#endif
+#ifdef FLOW_CONTROL_LED
+	// Only now, the host has set the LEDs to its state while we were waiting
+	usb_keyboard_flow_control(FLOW_CONTROL_LED);
+#endif
+#else
+	select_layout(DEFAULT_LAYOUT);
+#endif
 	
-	// chars: !"#$%&'()*+'-./
-	else if (chr > 32) {
-		switch (chr) {
-			case '!':
-				press_key = SKEY_EXCLAMATION;
-				press_modifier = SMOD_EXCLAMATION;
-				break;
-				
-			case '"':
-				press_key = SKEY_QUOTE;
-				press_modifier = SMOD_QUOTE;
-				break;
+	// Execute the compiled payload
+	execute_payload(select_slot());
+#ifndef CONSOLE_DEBUG
+	// The last keystrokes are still queued, returning would disable the interrupts
+	wait_sent();
+#ifdef WATCHDOG
+	// The payload is done, do not start it again
+	wdt_disable();
+#endif
+	LED_OFF;
+#endif
+	return 0;
+}
+
+/**
+ * Implementation of execute_payload(const uint8_t *code)
+ */
+void execute_payload(const uint8_t *code) {
+	uint8_t op, count, modifier, key, chr, i;
+#ifndef CONSOLE_DEBUG
+	uint8_t leds;
+#endif
+	uint16_t timeout, address;
+	
+	payload_start = code;
+	payload_depth = 0;
+	payload_seek(0);
+#ifndef CONSOLE_DEBUG
+	checkpoint = 0;
+	checkpoint_layout = keyboard_layout;
+	checkpoint_next_count = 0;
+	payload_resets = usb_resets();
+	payload_reports = usb_keyboard_sent();
+	sync_deadline();
+#endif
+	while (1) {
+#ifndef CONSOLE_DEBUG
+		if (usb_resets() != payload_resets) {
+			// The reset has dropped the reports still in the endpoint banks
+			promote_checkpoint(usb_keyboard_sent() - KEYBOARD_BANKS);
+			resume_checkpoint();
+		} else if (checkpoint_next_count) {
+			promote_checkpoint(usb_keyboard_taken());
+		}
+#endif
+		op = payload_read();
+		switch (op) {
+			// All keys together with the modifier
+			case OP_CHORD:
+				modifier = payload_read();
+				count = payload_read();
+#ifdef CONSOLE_DEBUG
+				printf("> Keystroke with modifier: %d and keys:", modifier);
+				for (i = 0; i < count; i++) {
+					printf(" %d", payload_read());
+				}
+				printf("\n");
+				debug_reports += 2;
+				debug_frames += 2;
+#else
+				usb_keyboard_release_all();
+				keyboard_modifier_keys = modifier;
+				for (i = 0; i < count; i++) {
+					usb_keyboard_key_down(payload_read());
+				}
 				
-			case '#':
-				press_key = SKEY_HASH;
-				press_modifier = SMOD_HASH;
+				// The same way usb_keyboard_press() is doing but not with one key but with all we where reading out before
+				queue_report(0);
+				usb_keyboard_release_all();
+				queue_report(0);
+#endif
 				break;
 				
-			case '$':
-				press_key = SKEY_DOLLAR;
-				press_modifier = SMOD_DOLLAR;
+			// Single keystrokes, one after the other
+			case OP_TYPE:
+				count = payload_read();
+				for (i = 0; i < count; i++) {
+					BENCH_ON(BENCH_PIN_LOOKUP);
+					chr = payload_read() - KEYBOARD_LAYOUT_FIRST;
+					key = KEY_NONE;
+					if (chr < KEYBOARD_LAYOUT_SIZE) {
+						key = pgm_read_byte(&keyboard_layout[chr][0]);
+						modifier = pgm_read_byte(&keyboard_layout[chr][1]);
+					}
+					BENCH_OFF(BENCH_PIN_LOOKUP);
+					if (key == KEY_NONE) continue;
+#ifdef CONSOLE_DEBUG
+					debug_chars++;
+					printf("  Char: %c, USB: %d, Modifier: %d%s\n", chr + KEYBOARD_LAYOUT_FIRST, key, modifier & ~KEY_DEAD, (modifier & KEY_DEAD) ? " + SPACE" : "");
+#endif
+					type_key(key, modifier & ~KEY_DEAD);
+					// A dead key only types its character together with the next one
+					if (modifier & KEY_DEAD) {
+						type_key(KEY_SPACE, KEY_NONE);
+					}
+				}
+				type_release();
 				break;
 				
-			case '%':
-				press_key = SKEY_PERCENT;
-				press_modifier = SMOD_PERCENT;
+			// Reports rendered by the payload_compiler, nothing to look up
+			case OP_REPORTS:
+				count = payload_read();
+				chr = payload_read();
+#ifdef CONSOLE_DEBUG
+				printf("> %d rendered reports\n", count);
+				debug_chars += chr;
+#endif
+				for (i = 0; i < count; i++) {
+					modifier = payload_read();
+					key = payload_read();
+					send_report(key, modifier, 0);
+				}
 				break;
 				
-			case '&':
-				press_key = SKEY_AND;
-				press_modifier = SMOD_AND;
+			// Wait for the given amount of milliseconds
+			case OP_WAIT:
+				timeout = payload_read();
+				timeout |= payload_read() << 8;
+#ifdef CONSOLE_DEBUG
+				printf("> Waiting for %d Milliseconds\n", timeout);
+				debug_wait += timeout;
+#else
+				wait_frames(timeout);
+#endif
 				break;
 				
-			case '\'':
-				press_key = SKEY_SINGLEQUOTE;
-				press_modifier = SMOD_SINGLEQUOTE;
+			// Wait until the host is ready by toggling a lock key until it answers with the LED
+			case OP_SYNC:
+				key = payload_read();
+				modifier = payload_read();
+				timeout = payload_read();
+				timeout |= payload_read() << 8;
+#ifdef CONSOLE_DEBUG
+				printf("> Toggle key %d twice, waiting up to %d Milliseconds for the LED %d\n", key, timeout, modifier);
+				debug_reports += 4;
+				debug_frames += 4;
+#else
+				// Only toggle it back if the host has switched it, otherwise it stays wrong
+				leds = keyboard_leds & modifier;
+				type_key(key, KEY_NONE);
+				type_release();
+				if (wait_led(modifier, leds ^ modifier, timeout)) {
+					type_key(key, KEY_NONE);
+					type_release();
+					wait_led(modifier, leds, timeout);
+				}
+				sync_deadline();
+#endif
 				break;
 				
-			case '(':
-				press_key = SKEY_LEFT_BRACE;
-				press_modifier = SMOD_LEFT_BRACE;
+			// Find the fastest typing speed for the rest of the payload
+			case OP_CALIBRATE:
+				timeout = payload_read();
+				timeout |= payload_read() << 8;
+#ifdef CONSOLE_DEBUG
+				printf("> Calibrating the typing speed, waiting up to %d Milliseconds for each burst\n", timeout);
+#else
+				calibrate(timeout);
+				sync_deadline();
+#endif
 				break;
 				
-			case ')':
-				press_key = SKEY_RIGHT_BRACE;
-				press_modifier = SMOD_RIGHT_BRACE;
+			// Switch the Keyboard-Layout
+			case OP_LAYOUT:
+				select_layout(payload_read());
+#ifdef CONSOLE_DEBUG
+				printf("> Switching the layout\n");
+#endif
 				break;
 				
-			case '*':
-				press_key = SKEY_ASTERISK;
-				press_modifier = SMOD_ASTERISK;
+			// Execute a subroutine, a repeated block or a string in the pool
+			case OP_CALL:
+				address = payload_read();
+				address |= payload_read() << 8;
+				count = payload_read();
+#ifdef CONSOLE_DEBUG
+				printf("> Calling a block %d times\n", count);
+#endif
+				if (count && (payload_depth < PAYLOAD_STACK_DEPTH)) {
+					payload_stack[payload_depth].start = payload_pool + address;
+					payload_stack[payload_depth].back = pool_cursor;
+					payload_stack[payload_depth].count = count;
+					pool_cursor = payload_pool + address;
+					payload_depth++;
+				}
 				break;
 				
-			case '+':
-				press_key = SKEY_PLUS;
-				press_modifier = SMOD_PLUS;
+			// Again from the start of the block or back to the OP_CALL
+			case OP_RETURN:
+				if (!payload_depth) {
+					break;
+				}
+				if (--payload_stack[payload_depth - 1].count) {
+					pool_cursor = payload_stack[payload_depth - 1].start;
+				} else {
+					payload_depth--;
+					pool_cursor = payload_stack[payload_depth].back;
+				}
 				break;
 				
-			case '-':
-				press_key = SKEY_MINUS;
-				press_modifier = SMOD_MINUS;
+			// Continue here after a bus reset
+			case OP_CHECKPOINT:
+#ifdef CONSOLE_DEBUG
+				printf("> Checkpoint\n");
+#else
+				checkpoint_marked = 1;
+				queue_checkpoint();
+#endif
 				break;
 				
-			case '.':
-				press_key = SKEY_PERIOD;
-				press_modifier = SMOD_PERIOD;
+			// The next line becomes the checkpoint once the host has taken this one
+			case OP_EOL:
+#ifndef CONSOLE_DEBUG
+				if (!checkpoint_marked) {
+					queue_checkpoint();
+				}
+#endif
 				break;
 				
-			case '/':
-				press_key = SKEY_SLASH;
-				press_modifier = SMOD_SLASH;
-				break;
+			default:
+#ifdef CONSOLE_DEBUG
+				printf("> End\n");
+				printf("> %lu characters, %lu reports in %lu frames, %.2f reports per character\n",
+					debug_chars, debug_reports, debug_frames, debug_chars ? (double)debug_reports / debug_chars : 0.0);
+				printf("> %lu ms typing, %lu ms waiting, %lu characters per second while typing\n",
+					debug_frames, debug_wait, debug_frames ? debug_chars * 1000 / debug_frames : 0);
+#else
+				// Not done before the host has all reports, after a bus
+				// reset it continues at the checkpoint
+				if (wait_taken()) {
+					break;
+				}
+#endif
+				return;
 		}
 	}
-	
-	// Nothing what we know yet
-	else {
-		press_key = KEY_NONE;
-	}
-	
-	// Only send a KeyStrokes if the values are valid.
-	// The range is from 4 up to 231
-	if (press_key <= 3 || press_key > 233) {
-		press_key = KEY_NONE;
-		press_modifier = KEY_NONE;
-	}
-}
-
-/**
- * Implementation of parse_special(char *str)
- */
-void parse_special(char *str, int *modifier) {
-	switch (*str) {
-		case 'A':
-		case 'a':
-			press_key = KEY_NONE;
-			*modifier = *modifier | KEY_ALT;
-			break;
-		case 'D':
-		case 'd':
-			press_key = KEY_DELETE;
-			break;
-		case 'C':
-		case 'c':
-			press_key = KEY_NONE;
-			*modifier = *modifier | KEY_CTRL;
-			break;
-		case 'E':
-		case 'e':
-			if ((*(str + 1) == 'S') || (*(str + 1) == 's')) {
-				press_key = KEY_ESC;
-			} else if ((*(str + 1) == 'N') || (*(str + 1) == 'n')) {
-			} else {
-				press_key = KEY_ENTER;
-			}
-			break;
-		case 'H':
-		case 'h':
-			press_key = KEY_HOME;
-			break;
-		case 'I':
-		case 'i':
-			press_key = KEY_INSERT;
-			break;
-		case 'P':
-		case 'p':
-			press_key = KEY_PRINTSCREEN;
-			break;
-		case 'R':
-		case 'r':
-			press_key = KEY_ENTER;
-			break;
-		case 'S':
-		case 's':
-			press_key = KEY_NONE;
-			*modifier = *modifier | KEY_SHIFT;
-			break;
-		case 'W':
-		case 'w':
-			press_key = SKEY_GUI;
-			break;
-		default:
-			press_key = KEY_NONE;
-			break;
-	}
 }
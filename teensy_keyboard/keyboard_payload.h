@@ -37,11 +37,18 @@
  * THE SOFTWARE.
  */
 
-#ifndef CONSOLE_DEBUG
+#if !defined CONSOLE_DEBUG && !defined PAYLOAD_COMPILER
 #include <avr/io.h>
 #include <avr/pgmspace.h>
 #include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
 #include <util/delay.h>
+#else
+// On the console and in the payload_compiler all data is in normal arrays and not in the flash
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(addr))
 #endif
 
 #include "usb_keyboard.h"
@@ -57,10 +64,54 @@
 #define LED_OFF     (PORTD &= ~(1<<6))
 
 
+// The bytecode created by payload_compiler.c out of the payload script
+#define OP_END    0x00 // End of the payload
+#define OP_EOL    0x01 // End of a line in the script
+#define OP_WAIT   0x02 // Wait, followed by the milliseconds as 16bit little endian
+#define OP_CHORD  0x03 // Followed by the modifier, the number of keys and the keys, all pressed together
+#define OP_TYPE   0x04 // Followed by the number of characters and the characters, see keyboard_layouts[]
+#define OP_LAYOUT 0x05 // Followed by the LAYOUT_* to use for all following characters
+#define OP_SYNC   0x06 // Followed by a lock key, its KEYBOARD_LED_* and the timeout in milliseconds, low byte first
+#define OP_CALIBRATE 0x07 // Followed by the timeout in milliseconds for each burst, low byte first
+#define OP_CHECKPOINT 0x08 // After a bus reset the payload continues here and not at the last line
+#define OP_REPORTS 0x09 // Followed by the number of reports, the characters they type and the modifier and key of each, see payload_compiler -r
+#define OP_CALL   0x0A // Followed by the address in payload_pool, low byte first, and how often to execute it
+#define OP_RETURN 0x0B // End of a block in payload_pool, back to the OP_CALL
+
+// The calibration sends CALIBRATE_BURST Num Lock toggles with a gap of
+// CALIBRATE_SLOWEST empty frames between the reports, then half of it and so
+// on, as long as the host switches the LED for every toggle.
+#define CALIBRATE_BURST   8
+#define CALIBRATE_SLOWEST 32
+
+// A report the host has not taken within RETRY_TIMEOUT frames is sent again after
+// RETRY_BACKOFF frames, and each time again twice as late, up to RETRY_BACKOFF_MAX.
+#define RETRY_TIMEOUT     50
+#define RETRY_BACKOFF     1
+#define RETRY_BACKOFF_MAX 128
+
+// The deadline of the OP_WAIT does not fall more than WAIT_RANGE frames behind
+// the frame clock, and longer waits are split, so its 16-bit difference stays valid
+#define WAIT_RANGE 16384
+
+// How many line starts can wait to become the checkpoint until the host has taken the
+// reports before them, see execute_payload()
+#define CHECKPOINT_LINES 8
+
+// How many OP_CALL can be nested, the payload_compiler checks it
+#define PAYLOAD_STACK_DEPTH 8
+
+// How many scripts the payload_compiler puts into the slots of one payload,
+// the PAYLOAD_JUMPER can select 16
+#define PAYLOAD_SLOTS_MAX 16
+
+
 // Different mappings for different special chars on the different keyboard layouts
 #define KEY_NONE	0x00
 #define KEY_NON_US	100
 #define KEY_ALTGR KEY_RIGHT_ALT
+// A dead key in a Keyboard-Layout, the character is typed by a SPACE after the key
+#define KEY_DEAD  KEY_RIGHT_GUI
 
 // If ALT, CTRL or GUI are not used as modifiers but as normal keystrokes
 #define SKEY_CTRL        224
@@ -77,299 +128,41 @@
 #define SKEY_RIGHT_GUI   231
 
 
-// Swiss Keyboards
-#if (defined MAPPING_CH && !defined KEYBOARD_MAPPING)
-#define KEYBOARD_MAPPING
-
-#define SKEY_LEFT_CURLYBRACE KEY_QUOTE
-#define SMOD_LEFT_CURLYBRACE KEY_ALTGR
-
-#define SKEY_RIGHT_CURLYBRACE KEY_BACKSLASH
-#define SMOD_RIGHT_CURLYBRACE KEY_ALTGR
-
-#define SKEY_TILDE KEY_EQUAL
-#define SMOD_TILDE KEY_ALTGR
-
-#define SKEY_PIPE KEY_7
-#define SMOD_PIPE KEY_ALTGR
-
-#define SKEY_LEFT_SQUAREBRACE KEY_LEFT_BRACE
-#define SMOD_LEFT_SQUAREBRACE KEY_ALTGR
-
-#define SKEY_RIGHT_SQUAREBRACE KEY_RIGHT_BRACE
-#define SMOD_RIGHT_SQUAREBRACE KEY_ALTGR
-
-#define SKEY_BACKSLASH KEY_NON_US
-#define SMOD_BACKSLASH KEY_ALTGR
-
-#define SKEY_ROOF KEY_EQUAL
-#define SMOD_ROOF KEY_NONE
-
-#define SKEY_UNDERLINE KEY_SLASH
-#define SMOD_UNDERLINE KEY_SHIFT
-
-#define SKEY_BACKQUOTE KEY_QUOTE
-#define SMOD_BACKQUOTE KEY_SHIFT
-
-#define SKEY_DOUBLEPOINT KEY_PERIOD
-#define SMOD_DOUBLEPOINT KEY_SHIFT
-
-#define SKEY_SEMICOLON KEY_COMMA
-#define SMOD_SEMICOLON KEY_SHIFT
-
-#define SKEY_SMALLERTHAN KEY_NON_US
-#define SMOD_SMALLERTHAN KEY_NONE
-
-#define SKEY_GREATERTHAN KEY_NON_US
-#define SMOD_GREATERTHAN KEY_SHIFT
-
-#define SKEY_EQUAL KEY_0
-#define SMOD_EQUAL KEY_SHIFT
-
-#define SKEY_QUESTION KEY_MINUS
-#define SMOD_QUESTION KEY_SHIFT
-
-#define SKEY_AT KEY_2
-#define SMOD_AT KEY_ALTGR
-
-#define SKEY_EXCLAMATION KEY_RIGHT_BRACE
-#define SMOD_EXCLAMATION KEY_SHIFT
-
-#define SKEY_QUOTE KEY_2
-#define SMOD_QUOTE KEY_SHIFT
-
-#define SKEY_HASH KEY_3
-#define SMOD_HASH KEY_ALTGR
-
-#define SKEY_DOLLAR KEY_BACKSLASH
-#define SMOD_DOLLAR KEY_NONE
-
-#define SKEY_PERCENT KEY_5
-#define SMOD_PERCENT KEY_SHIFT
-
-#define SKEY_AND KEY_6
-#define SMOD_AND KEY_SHIFT
-
-#define SKEY_SINGLEQUOTE KEY_MINUS
-#define SMOD_SINGLEQUOTE KEY_NONE
-
-#define SKEY_LEFT_BRACE KEY_8
-#define SMOD_LEFT_BRACE KEY_SHIFT
-
-#define SKEY_RIGHT_BRACE KEY_9
-#define SMOD_RIGHT_BRACE KEY_SHIFT
-
-#define SKEY_ASTERISK KEY_3
-#define SMOD_ASTERISK KEY_SHIFT
-
-#define SKEY_PLUS KEY_1
-#define SMOD_PLUS KEY_SHIFT
-
-#define SKEY_MINUS KEY_SLASH
-#define SMOD_MINUS KEY_NONE
-
-#define SKEY_PERIOD KEY_PERIOD
-#define SMOD_PERIOD KEY_NONE
-
-#define SKEY_SLASH KEY_7
-#define SMOD_SLASH KEY_SHIFT
-
-
-// German keyboards
-#elif (defined MAPPING_DE && !defined KEYBOARD_MAPPING)
-#define KEYBOARD_MAPPING
-
-#define SKEY_LEFT_CURLYBRACE KEY_7
-#define SMOD_LEFT_CURLYBRACE KEY_ALTGR
-
-#define SKEY_RIGHT_CURLYBRACE KEY_0
-#define SMOD_RIGHT_CURLYBRACE KEY_ALTGR
-
-#define SKEY_TILDE KEY_RIGHT_BRACE
-#define SMOD_TILDE KEY_ALTGR
-
-#define SKEY_PIPE KEY_NON_US
-#define SMOD_PIPE KEY_ALTGR
-
-#define SKEY_LEFT_SQUAREBRACE KEY_8
-#define SMOD_LEFT_SQUAREBRACE KEY_ALTGR
-
-#define SKEY_RIGHT_SQUAREBRACE KEY_9
-#define SMOD_RIGHT_SQUAREBRACE KEY_ALTGR
-
-#define SKEY_BACKSLASH KEY_MINUS
-#define SMOD_BACKSLASH KEY_ALTGR
-
-#define SKEY_ROOF KEY_TILDE
-#define SMOD_ROOF KEY_NONE
-
-#define SKEY_UNDERLINE KEY_SLASH
-#define SMOD_UNDERLINE KEY_SHIFT
-
-#define SKEY_BACKQUOTE KEY_EQUAL
-#define SMOD_BACKQUOTE KEY_SHIFT
-
-#define SKEY_DOUBLEPOINT KEY_PERIOD
-#define SMOD_DOUBLEPOINT KEY_SHIFT
-
-#define SKEY_SEMICOLON KEY_COMMA
-#define SMOD_SEMICOLON KEY_SHIFT
-
-#define SKEY_SMALLERTHAN KEY_NON_US
-#define SMOD_SMALLERTHAN KEY_NONE
-
-#define SKEY_GREATERTHAN KEY_NON_US
-#define SMOD_GREATERTHAN KEY_SHIFT
-
-#define SKEY_EQUAL KEY_0
-#define SMOD_EQUAL KEY_SHIFT
-
-#define SKEY_QUESTION KEY_MINUS
-#define SMOD_QUESTION KEY_SHIFT
-
-#define SKEY_AT KEY_Q
-#define SMOD_AT KEY_ALTGR
-
-#define SKEY_EXCLAMATION KEY_1
-#define SMOD_EXCLAMATION KEY_SHIFT
-
-#define SKEY_QUOTE KEY_2
-#define SMOD_QUOTE KEY_SHIFT
-
-#define SKEY_HASH KEY_BACKSLASH
-#define SMOD_HASH KEY_NONE
-
-#define SKEY_DOLLAR KEY_4
-#define SMOD_DOLLAR KEY_SHIFT
-
-#define SKEY_PERCENT KEY_5
-#define SMOD_PERCENT KEY_SHIFT
-
-#define SKEY_AND KEY_6
-#define SMOD_AND KEY_SHIFT
-
-#define SKEY_SINGLEQUOTE KEY_BACKSLASH
-#define SMOD_SINGLEQUOTE KEY_SHIFT
-
-#define SKEY_LEFT_BRACE KEY_8
-#define SMOD_LEFT_BRACE KEY_SHIFT
-
-#define SKEY_RIGHT_BRACE KEY_9
-#define SMOD_RIGHT_BRACE KEY_SHIFT
-
-#define SKEY_ASTERISK KEY_RIGHT_BRACE
-#define SMOD_ASTERISK KEY_SHIFT
-
-#define SKEY_PLUS KEY_RIGHT_BRACE
-#define SMOD_PLUS KEY_NONE
-
-#define SKEY_MINUS KEY_SLASH
-#define SMOD_MINUS KEY_NONE
-
-#define SKEY_PERIOD KEY_PERIOD
-#define SMOD_PERIOD KEY_NONE
-
-#define SKEY_SLASH KEY_7
-#define SMOD_SLASH KEY_SHIFT
-
-
-// US and others
-#elif !defined KEYBOARD_MAPPING
-#define KEYBOARD_MAPPING
-
-#define SKEY_LEFT_CURLYBRACE KEY_LEFT_BRACE
-#define SMOD_LEFT_CURLYBRACE KEY_SHIFT
-
-#define SKEY_RIGHT_CURLYBRACE KEY_RIGHT_BRACE
-#define SMOD_RIGHT_CURLYBRACE KEY_SHIFT
-
-#define SKEY_TILDE KEY_TILDE
-#define SMOD_TILDE KEY_SHIFT
-
-#define SKEY_PIPE KEY_BACKSLASH
-#define SMOD_PIPE KEY_SHIFT
-
-#define SKEY_LEFT_SQUAREBRACE KEY_LEFT_BRACE
-#define SMOD_LEFT_SQUAREBRACE KEY_NONE
-
-#define SKEY_RIGHT_SQUAREBRACE KEY_RIGHT_BRACE
-#define SMOD_RIGHT_SQUAREBRACE KEY_NONE
-
-#define SKEY_BACKSLASH KEY_BACKSLASH
-#define SMOD_BACKSLASH KEY_NONE
-
-#define SKEY_ROOF KEY_6
-#define SMOD_ROOF KEY_SHIFT
-
-#define SKEY_UNDERLINE KEY_MINUS
-#define SMOD_UNDERLINE KEY_SHIFT
-
-#define SKEY_BACKQUOTE KEY_TILDE
-#define SMOD_BACKQUOTE KEY_NONE
-
-#define SKEY_DOUBLEPOINT KEY_SEMICOLON
-#define SMOD_DOUBLEPOINT KEY_SHIFT
-
-#define SKEY_SEMICOLON KEY_SEMICOLON
-#define SMOD_SEMICOLON KEY_NONE
-
-#define SKEY_SMALLERTHAN KEY_COMMA
-#define SMOD_SMALLERTHAN KEY_SHIFT
-
-#define SKEY_GREATERTHAN KEY_PERIOD
-#define SMOD_GREATERTHAN KEY_SHIFT
-
-#define SKEY_EQUAL KEY_EQUAL
-#define SMOD_EQUAL KEY_NONE
-
-#define SKEY_QUESTION KEY_SLASH
-#define SMOD_QUESTION KEY_SHIFT
-
-#define SKEY_AT KEY_2
-#define SMOD_AT KEY_SHIFT
-
-#define SKEY_EXCLAMATION KEY_1
-#define SMOD_EXCLAMATION KEY_SHIFT
-
-#define SKEY_QUOTE KEY_QUOTE
-#define SMOD_QUOTE KEY_SHIFT
-
-#define SKEY_HASH KEY_3
-#define SMOD_HASH KEY_SHIFT
-
-#define SKEY_DOLLAR KEY_4
-#define SMOD_DOLLAR KEY_SHIFT
-
-#define SKEY_PERCENT KEY_5
-#define SMOD_PERCENT KEY_SHIFT
-
-#define SKEY_AND KEY_7
-#define SMOD_AND KEY_SHIFT
-
-#define SKEY_SINGLEQUOTE KEY_QUOTE
-#define SMOD_SINGLEQUOTE KEY_NONE
-
-#define SKEY_LEFT_BRACE KEY_9
-#define SMOD_LEFT_BRACE KEY_SHIFT
-
-#define SKEY_RIGHT_BRACE KEY_0
-#define SMOD_RIGHT_BRACE KEY_SHIFT
-
-#define SKEY_ASTERISK KEY_8
-#define SMOD_ASTERISK KEY_SHIFT
-
-#define SKEY_PLUS KEY_EQUAL
-#define SMOD_PLUS KEY_SHIFT
-
-#define SKEY_MINUS KEY_MINUS
-#define SMOD_MINUS KEY_NONE
-
-#define SKEY_PERIOD KEY_PERIOD
-#define SMOD_PERIOD KEY_NONE
-
-#define SKEY_SLASH KEY_SLASH
-#define SMOD_SLASH KEY_NONE
-
-#endif
+// All Keyboard-Layouts are in the flash together, see keyboard_layouts[]
+// Each one holds the USB-Keyboard Scancode and Modifier for each printable
+// character from the SPACE (32) up to DEL (127), a key KEY_NONE means
+// the character can not be typed with that layout.
+#define KEYBOARD_LAYOUT_FIRST 32
+#define KEYBOARD_LAYOUT_SIZE  96
+
+#include "layout_us.h"
+#include "layout_ch.h"
+#include "layout_de.h"
+#include "layout_fr.h"
+#include "layout_uk.h"
+#include "layout_se.h"
+#include "layout_no.h"
+#include "layout_dk.h"
+
+#define LAYOUT_US    0
+#define LAYOUT_CH    1
+#define LAYOUT_DE    2
+#define LAYOUT_FR    3
+#define LAYOUT_UK    4
+#define LAYOUT_SE    5
+#define LAYOUT_NO    6
+#define LAYOUT_DK    7
+#define LAYOUT_COUNT 8
+
+static const uint8_t (* const PROGMEM keyboard_layouts[LAYOUT_COUNT])[2] = {
+	layout_us,
+	layout_ch,
+	layout_de,
+	layout_fr,
+	layout_uk,
+	layout_se,
+	layout_no,
+	layout_dk
+};
 
 #endif
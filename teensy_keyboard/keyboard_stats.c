@@ -0,0 +1,104 @@
+/**
+ * Host tool which reads the counters of a running Teensy keyboard.
+ *
+ * The counters are in a HID feature report of the keyboard, see
+ * struct keyboard_stats_struct in usb_keyboard.h. They are read through
+ * the hidraw device of the keyboard on Linux:
+ * shell> ./keyboard_stats /dev/hidraw0
+ *
+ * @author Lukas Zurschmiede <l.zurschmiede@ranta.ch>
+ * @version 0.1
+ * @package teensy_keyboard
+ * @license GPL-v3
+ */
+
+/* License:
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+
+#include "usb_keyboard.h"
+
+// The CPU clock, to show the interrupt cycles in microseconds
+#define CPU_MHZ 16
+
+/**
+ * The frames of each histogram class in struct keyboard_stats_struct
+ */
+static const char *wait_names[KEYBOARD_STATS_WAITS] = {
+	"0", "1", "2", "3-4", "5-8", "9-16", "17-32", "33+"
+};
+
+/**
+ * Read a 16bit little endian value out of the report
+ *
+ * @param report The report
+ * @param offset The position of the value
+ * @return The value
+ */
+static unsigned read_word(const uint8_t *report, size_t offset) {
+	return report[offset] | (report[offset + 1] << 8);
+}
+
+int main(int argc, char **argv) {
+	// The first byte is the report number, the keyboard has none so it is 0
+	uint8_t buffer[1 + sizeof(struct keyboard_stats_struct)] = { 0 };
+	const uint8_t *report = buffer + 1;
+	unsigned sent, cycles, count;
+	int fd, length, i;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s </dev/hidrawN>\n", argv[0]);
+		return 1;
+	}
+	fd = open(argv[1], O_RDWR);
+	if (fd < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+	length = ioctl(fd, HIDIOCGFEATURE(sizeof(buffer)), buffer);
+	close(fd);
+	if (length < (int)sizeof(buffer)) {
+		fprintf(stderr, "%s: no counters, is it the Teensy keyboard?\n", argv[1]);
+		return 1;
+	}
+
+	sent = read_word(report, offsetof(struct keyboard_stats_struct, sent));
+	cycles = read_word(report, offsetof(struct keyboard_stats_struct, isr_cycles));
+	printf("Reports sent:                 %u\n", sent);
+	printf("Frames waiting for a bank:    %u\n", read_word(report, offsetof(struct keyboard_stats_struct, bank_wait)));
+	printf("Waits on a full queue:        %u\n", read_word(report, offsetof(struct keyboard_stats_struct, full_waits)));
+	printf("Retries:                      %u\n", read_word(report, offsetof(struct keyboard_stats_struct, retries)));
+	printf("Longest USB interrupt:        %u cycles, %u us\n", cycles, cycles / CPU_MHZ);
+	printf("Most reports in the queue:    %u\n", report[offsetof(struct keyboard_stats_struct, queue_high)]);
+	printf("Frames from queue to endpoint:\n");
+	for (i = 0; i < KEYBOARD_STATS_WAITS; i++) {
+		count = read_word(report, offsetof(struct keyboard_stats_struct, waits) + i * 2);
+		printf("  %6s: %6u  %5.1f%%\n", wait_names[i], count, sent ? count * 100.0 / sent : 0.0);
+	}
+	return 0;
+}
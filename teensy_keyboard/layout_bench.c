@@ -0,0 +1,226 @@
+/**
+ * Host benchmark of the character lookup: the keyboard_layouts[] table
+ * the teensy uses against the parse_char() branch ladder it replaced.
+ *
+ * The ladder is the old one with the values of the US layout written out,
+ * both translate every printable ASCII character and have to agree on all
+ * of them. The best of all runs is printed, in CPU cycles on x86 and in
+ * nanoseconds everywhere:
+ * shell> make bench-layout
+ *
+ * @author Lukas Zurschmiede <l.zurschmiede@ranta.ch>
+ * @version 0.1
+ * @package teensy_keyboard
+ * @license GPL-v3
+ */
+
+/* License:
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define CONSOLE_DEBUG
+
+#include <stdio.h>
+#include <time.h>
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
+
+#include "config.h"
+#include "keyboard_payload.h"
+
+// How often all characters are translated, and how often that is measured
+#define ROUNDS 1000
+#define RUNS   2000
+
+/**
+ * The key and modifier of the last translated character, volatile so the
+ * compiler can not leave out the translations
+ */
+static volatile uint8_t press_key, press_modifier;
+
+/**
+ * Translate a character with the old branch ladder, with the US layout
+ *
+ * @param chr The character
+ */
+static void __attribute__((noinline)) ladder_char(uint8_t chr) {
+	uint8_t key = KEY_NONE, modifier = KEY_NONE;
+
+	if (chr == 32) {
+		key = KEY_SPACE;
+	}
+	else if (chr > 122) {
+		switch (chr) {
+			case '{': key = KEY_LEFT_BRACE; modifier = KEY_SHIFT; break;
+			case '}': key = KEY_RIGHT_BRACE; modifier = KEY_SHIFT; break;
+			case '|': key = KEY_BACKSLASH; modifier = KEY_SHIFT; break;
+			case '~': key = KEY_TILDE; modifier = KEY_SHIFT; break;
+		}
+	}
+	else if (chr > 96) {
+		key = chr - (97 - 4);
+	}
+	else if (chr > 90) {
+		switch (chr) {
+			case '[': key = KEY_LEFT_BRACE; break;
+			case ']': key = KEY_RIGHT_BRACE; break;
+			case '\\': key = KEY_BACKSLASH; break;
+			case '^': key = KEY_6; modifier = KEY_SHIFT; break;
+			case '_': key = KEY_MINUS; modifier = KEY_SHIFT; break;
+			case '`': key = KEY_TILDE; break;
+		}
+	}
+	else if (chr > 64) {
+		key = chr - (65 - 4);
+		modifier = KEY_SHIFT;
+	}
+	else if (chr > 57) {
+		switch (chr) {
+			case ':': key = KEY_SEMICOLON; modifier = KEY_SHIFT; break;
+			case ';': key = KEY_SEMICOLON; break;
+			case '<': key = KEY_COMMA; modifier = KEY_SHIFT; break;
+			case '>': key = KEY_PERIOD; modifier = KEY_SHIFT; break;
+			case '=': key = KEY_EQUAL; break;
+			case '?': key = KEY_SLASH; modifier = KEY_SHIFT; break;
+			case '@': key = KEY_2; modifier = KEY_SHIFT; break;
+		}
+	}
+	else if (chr == 48) {
+		key = KEY_0;
+	}
+	else if (chr > 48) {
+		key = chr - (49 - 30);
+	}
+	else if (chr > 32) {
+		switch (chr) {
+			case '!': key = KEY_1; modifier = KEY_SHIFT; break;
+			case '"': key = KEY_QUOTE; modifier = KEY_SHIFT; break;
+			case '#': key = KEY_3; modifier = KEY_SHIFT; break;
+			case '$': key = KEY_4; modifier = KEY_SHIFT; break;
+			case '%': key = KEY_5; modifier = KEY_SHIFT; break;
+			case '&': key = KEY_7; modifier = KEY_SHIFT; break;
+			case '\'': key = KEY_QUOTE; break;
+			case '(': key = KEY_9; modifier = KEY_SHIFT; break;
+			case ')': key = KEY_0; modifier = KEY_SHIFT; break;
+			case '*': key = KEY_8; modifier = KEY_SHIFT; break;
+			case '+': key = KEY_EQUAL; modifier = KEY_SHIFT; break;
+			case ',': key = KEY_COMMA; break;
+			case '-': key = KEY_MINUS; break;
+			case '.': key = KEY_PERIOD; break;
+			case '/': key = KEY_SLASH; break;
+		}
+	}
+	press_key = key;
+	press_modifier = modifier;
+}
+
+/**
+ * Translate a character with the keyboard_layouts[] table, the same way
+ * execute_payload() does it for OP_TYPE
+ *
+ * @param chr The character
+ */
+static void __attribute__((noinline)) table_char(uint8_t chr) {
+	const uint8_t (*layout)[2] = keyboard_layouts[LAYOUT_US];
+
+	press_key = pgm_read_byte(&layout[chr - KEYBOARD_LAYOUT_FIRST][0]);
+	press_modifier = pgm_read_byte(&layout[chr - KEYBOARD_LAYOUT_FIRST][1]);
+}
+
+/**
+ * The CPU cycles on x86, 0 everywhere else
+ *
+ * @return The time stamp counter
+ */
+static unsigned long long cycles(void) {
+#ifdef __x86_64__
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/**
+ * The time in nanoseconds
+ *
+ * @return The monotonic clock
+ */
+static unsigned long long nanoseconds(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Translate all characters ROUNDS times, RUNS times, and print the best run
+ *
+ * @param *name Name of the translation
+ * @param translate The translation to measure
+ */
+static void measure(const char *name, void (*translate)(uint8_t)) {
+	unsigned long long start_cycles, start_ns, best_cycles = ~0ULL, best_ns = ~0ULL;
+	double chars = (double)ROUNDS * (KEYBOARD_LAYOUT_SIZE - 1);
+	int run, round, chr;
+
+	for (run = 0; run < RUNS; run++) {
+		start_ns = nanoseconds();
+		start_cycles = cycles();
+		for (round = 0; round < ROUNDS; round++) {
+			for (chr = KEYBOARD_LAYOUT_FIRST; chr < KEYBOARD_LAYOUT_FIRST + KEYBOARD_LAYOUT_SIZE - 1; chr++) {
+				translate(chr);
+			}
+		}
+		start_cycles = cycles() - start_cycles;
+		start_ns = nanoseconds() - start_ns;
+		if (start_cycles < best_cycles) {
+			best_cycles = start_cycles;
+		}
+		if (start_ns < best_ns) {
+			best_ns = start_ns;
+		}
+	}
+	printf("%-7s %6.2f cycles/char %6.2f ns/char\n", name, best_cycles / chars, best_ns / chars);
+}
+
+int main(void) {
+	uint8_t key, modifier;
+	int chr, errors = 0;
+
+	// Both have to give the same keys, DEL (127) can not be typed
+	for (chr = KEYBOARD_LAYOUT_FIRST; chr < KEYBOARD_LAYOUT_FIRST + KEYBOARD_LAYOUT_SIZE - 1; chr++) {
+		ladder_char(chr);
+		key = press_key;
+		modifier = press_modifier;
+		table_char(chr);
+		if ((key != press_key) || (modifier != press_modifier)) {
+			fprintf(stderr, "'%c': ladder 0x%02x/0x%02x, table 0x%02x/0x%02x\n", chr, key, modifier, press_key, press_modifier);
+			errors++;
+		}
+	}
+	if (errors) {
+		return 1;
+	}
+
+	measure("ladder", ladder_char);
+	measure("table", table_char);
+	return 0;
+}
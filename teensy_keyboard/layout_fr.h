@@ -0,0 +1,115 @@
+/**
+ * FR Keyboard-Layout
+ * Generated by layout_generator from XKB fr(basic)
+ * 
+ * The USB-Keyboard Scancode and Modifier for each printable character
+ * from the SPACE (32) up to DEL (127), see keyboard_layouts[]
+ * 
+ * @author Lukas Zurschmiede <l.zurschmiede@ranta.ch>
+ * @package teensy_keyboard
+ * @license GPL-v3
+ */
+
+#ifndef LAYOUT_FR_H
+#define LAYOUT_FR_H
+
+static const uint8_t PROGMEM layout_fr[KEYBOARD_LAYOUT_SIZE][2] = {
+	{ KEY_SPACE, KEY_NONE },		// ' '
+	{ KEY_SLASH, KEY_NONE },		// '!'
+	{ KEY_3, KEY_NONE },			// '"'
+	{ KEY_3, KEY_ALTGR },			// '#'
+	{ KEY_RIGHT_BRACE, KEY_NONE },		// '$'
+	{ KEY_QUOTE, KEY_SHIFT },		// '%'
+	{ KEY_1, KEY_NONE },			// '&'
+	{ KEY_4, KEY_NONE },			// '\''
+	{ KEY_5, KEY_NONE },			// '('
+	{ KEY_MINUS, KEY_NONE },		// ')'
+	{ KEY_BACKSLASH, KEY_NONE },		// '*'
+	{ KEY_EQUAL, KEY_SHIFT },		// '+'
+	{ KEY_M, KEY_NONE },			// ','
+	{ KEY_6, KEY_NONE },			// '-'
+	{ KEY_COMMA, KEY_SHIFT },		// '.'
+	{ KEY_PERIOD, KEY_SHIFT },		// '/'
+	{ KEY_0, KEY_SHIFT },			// '0'
+	{ KEY_1, KEY_SHIFT },			// '1'
+	{ KEY_2, KEY_SHIFT },			// '2'
+	{ KEY_3, KEY_SHIFT },			// '3'
+	{ KEY_4, KEY_SHIFT },			// '4'
+	{ KEY_5, KEY_SHIFT },			// '5'
+	{ KEY_6, KEY_SHIFT },			// '6'
+	{ KEY_7, KEY_SHIFT },			// '7'
+	{ KEY_8, KEY_SHIFT },			// '8'
+	{ KEY_9, KEY_SHIFT },			// '9'
+	{ KEY_PERIOD, KEY_NONE },		// ':'
+	{ KEY_COMMA, KEY_NONE },		// ';'
+	{ KEY_NON_US, KEY_NONE },		// '<'
+	{ KEY_EQUAL, KEY_NONE },		// '='
+	{ KEY_NON_US, KEY_SHIFT },		// '>'
+	{ KEY_M, KEY_SHIFT },			// '?'
+	{ KEY_0, KEY_ALTGR },			// '@'
+	{ KEY_Q, KEY_SHIFT },			// 'A'
+	{ KEY_B, KEY_SHIFT },			// 'B'
+	{ KEY_C, KEY_SHIFT },			// 'C'
+	{ KEY_D, KEY_SHIFT },			// 'D'
+	{ KEY_E, KEY_SHIFT },			// 'E'
+	{ KEY_F, KEY_SHIFT },			// 'F'
+	{ KEY_G, KEY_SHIFT },			// 'G'
+	{ KEY_H, KEY_SHIFT },			// 'H'
+	{ KEY_I, KEY_SHIFT },			// 'I'
+	{ KEY_J, KEY_SHIFT },			// 'J'
+	{ KEY_K, KEY_SHIFT },			// 'K'
+	{ KEY_L, KEY_SHIFT },			// 'L'
+	{ KEY_SEMICOLON, KEY_SHIFT },		// 'M'
+	{ KEY_N, KEY_SHIFT },			// 'N'
+	{ KEY_O, KEY_SHIFT },			// 'O'
+	{ KEY_P, KEY_SHIFT },			// 'P'
+	{ KEY_A, KEY_SHIFT },			// 'Q'
+	{ KEY_R, KEY_SHIFT },			// 'R'
+	{ KEY_S, KEY_SHIFT },			// 'S'
+	{ KEY_T, KEY_SHIFT },			// 'T'
+	{ KEY_U, KEY_SHIFT },			// 'U'
+	{ KEY_V, KEY_SHIFT },			// 'V'
+	{ KEY_Z, KEY_SHIFT },			// 'W'
+	{ KEY_X, KEY_SHIFT },			// 'X'
+	{ KEY_Y, KEY_SHIFT },			// 'Y'
+	{ KEY_W, KEY_SHIFT },			// 'Z'
+	{ KEY_5, KEY_ALTGR },			// '['
+	{ KEY_8, KEY_ALTGR },			// '\\'
+	{ KEY_MINUS, KEY_ALTGR },		// ']'
+	{ KEY_9, KEY_ALTGR },			// '^'
+	{ KEY_8, KEY_NONE },			// '_'
+	{ KEY_7, KEY_ALTGR },			// '`'
+	{ KEY_Q, KEY_NONE },			// 'a'
+	{ KEY_B, KEY_NONE },			// 'b'
+	{ KEY_C, KEY_NONE },			// 'c'
+	{ KEY_D, KEY_NONE },			// 'd'
+	{ KEY_E, KEY_NONE },			// 'e'
+	{ KEY_F, KEY_NONE },			// 'f'
+	{ KEY_G, KEY_NONE },			// 'g'
+	{ KEY_H, KEY_NONE },			// 'h'
+	{ KEY_I, KEY_NONE },			// 'i'
+	{ KEY_J, KEY_NONE },			// 'j'
+	{ KEY_K, KEY_NONE },			// 'k'
+	{ KEY_L, KEY_NONE },			// 'l'
+	{ KEY_SEMICOLON, KEY_NONE },		// 'm'
+	{ KEY_N, KEY_NONE },			// 'n'
+	{ KEY_O, KEY_NONE },			// 'o'
+	{ KEY_P, KEY_NONE },			// 'p'
+	{ KEY_A, KEY_NONE },			// 'q'
+	{ KEY_R, KEY_NONE },			// 'r'
+	{ KEY_S, KEY_NONE },			// 's'
+	{ KEY_T, KEY_NONE },			// 't'
+	{ KEY_U, KEY_NONE },			// 'u'
+	{ KEY_V, KEY_NONE },			// 'v'
+	{ KEY_Z, KEY_NONE },			// 'w'
+	{ KEY_X, KEY_NONE },			// 'x'
+	{ KEY_Y, KEY_NONE },			// 'y'
+	{ KEY_W, KEY_NONE },			// 'z'
+	{ KEY_4, KEY_ALTGR },			// '{'
+	{ KEY_6, KEY_ALTGR },			// '|'
+	{ KEY_EQUAL, KEY_ALTGR },		// '}'
+	{ KEY_TILDE, KEY_SHIFT },		// '~'
+	{ KEY_NONE, KEY_NONE },			// DEL
+};
+
+#endif
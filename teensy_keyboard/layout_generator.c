@@ -0,0 +1,713 @@
+/**
+ * Host tool which creates a layout_xx.h Keyboard-Layout table out of a
+ * XKB symbols file (Linux) or a KLC file (Microsoft Keyboard Layout Creator).
+ *
+ * For each printable character the key with the least modifiers is taken,
+ * a character which can only be typed with a dead key gets the KEY_DEAD
+ * modifier, so it is followed by a SPACE. A coverage report lists all
+ * characters which need a dead key or can not be typed at all.
+ *
+ * The new layout has to be added to keyboard_layouts[] in keyboard_payload.h
+ * and to the layout_names[] in payload_compiler.c
+ *
+ * @author Lukas Zurschmiede <l.zurschmiede@ranta.ch>
+ * @version 0.1
+ * @package teensy_keyboard
+ * @license GPL-v3
+ */
+
+/* License:
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/**
+ * Usage:
+ * shell> gcc layout_generator.c -o layout_generator
+ * shell> ./layout_generator xkb /usr/share/X11/xkb/symbols/fr basic FR layout_fr.h
+ * shell> ./layout_generator klc kbdfr.klc FR layout_fr.h
+ */
+
+#define PAYLOAD_COMPILER
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "config.h"
+#include "keyboard_payload.h"
+
+/**
+ * Number of shift levels we can type: None, Shift, AltGr, AltGr+Shift
+ */
+#define LEVELS 4
+
+/**
+ * Maximum depth of nested XKB includes
+ */
+#define MAX_INCLUDE_DEPTH 8
+
+/**
+ * All keys of the main block, with the XKB name, the Set-1 Scancode used
+ * in KLC files and the USB-Keyboard Scancode
+ */
+static const struct layout_key {
+	const char *xkb;
+	uint8_t scancode;
+	uint8_t key;
+	const char *name;
+} layout_keys[] = {
+	{ "SPCE", 0x39, KEY_SPACE, "KEY_SPACE" },
+	{ "AE01", 0x02, KEY_1, "KEY_1" },
+	{ "AE02", 0x03, KEY_2, "KEY_2" },
+	{ "AE03", 0x04, KEY_3, "KEY_3" },
+	{ "AE04", 0x05, KEY_4, "KEY_4" },
+	{ "AE05", 0x06, KEY_5, "KEY_5" },
+	{ "AE06", 0x07, KEY_6, "KEY_6" },
+	{ "AE07", 0x08, KEY_7, "KEY_7" },
+	{ "AE08", 0x09, KEY_8, "KEY_8" },
+	{ "AE09", 0x0a, KEY_9, "KEY_9" },
+	{ "AE10", 0x0b, KEY_0, "KEY_0" },
+	{ "AE11", 0x0c, KEY_MINUS, "KEY_MINUS" },
+	{ "AE12", 0x0d, KEY_EQUAL, "KEY_EQUAL" },
+	{ "AD01", 0x10, KEY_Q, "KEY_Q" },
+	{ "AD02", 0x11, KEY_W, "KEY_W" },
+	{ "AD03", 0x12, KEY_E, "KEY_E" },
+	{ "AD04", 0x13, KEY_R, "KEY_R" },
+	{ "AD05", 0x14, KEY_T, "KEY_T" },
+	{ "AD06", 0x15, KEY_Y, "KEY_Y" },
+	{ "AD07", 0x16, KEY_U, "KEY_U" },
+	{ "AD08", 0x17, KEY_I, "KEY_I" },
+	{ "AD09", 0x18, KEY_O, "KEY_O" },
+	{ "AD10", 0x19, KEY_P, "KEY_P" },
+	{ "AD11", 0x1a, KEY_LEFT_BRACE, "KEY_LEFT_BRACE" },
+	{ "AD12", 0x1b, KEY_RIGHT_BRACE, "KEY_RIGHT_BRACE" },
+	{ "AC01", 0x1e, KEY_A, "KEY_A" },
+	{ "AC02", 0x1f, KEY_S, "KEY_S" },
+	{ "AC03", 0x20, KEY_D, "KEY_D" },
+	{ "AC04", 0x21, KEY_F, "KEY_F" },
+	{ "AC05", 0x22, KEY_G, "KEY_G" },
+	{ "AC06", 0x23, KEY_H, "KEY_H" },
+	{ "AC07", 0x24, KEY_J, "KEY_J" },
+	{ "AC08", 0x25, KEY_K, "KEY_K" },
+	{ "AC09", 0x26, KEY_L, "KEY_L" },
+	{ "AC10", 0x27, KEY_SEMICOLON, "KEY_SEMICOLON" },
+	{ "AC11", 0x28, KEY_QUOTE, "KEY_QUOTE" },
+	{ "BKSL", 0x2b, KEY_BACKSLASH, "KEY_BACKSLASH" },
+	{ "AB01", 0x2c, KEY_Z, "KEY_Z" },
+	{ "AB02", 0x2d, KEY_X, "KEY_X" },
+	{ "AB03", 0x2e, KEY_C, "KEY_C" },
+	{ "AB04", 0x2f, KEY_V, "KEY_V" },
+	{ "AB05", 0x30, KEY_B, "KEY_B" },
+	{ "AB06", 0x31, KEY_N, "KEY_N" },
+	{ "AB07", 0x32, KEY_M, "KEY_M" },
+	{ "AB08", 0x33, KEY_COMMA, "KEY_COMMA" },
+	{ "AB09", 0x34, KEY_PERIOD, "KEY_PERIOD" },
+	{ "AB10", 0x35, KEY_SLASH, "KEY_SLASH" },
+	{ "TLDE", 0x29, KEY_TILDE, "KEY_TILDE" },
+	{ "LSGT", 0x56, KEY_NON_US, "KEY_NON_US" }
+};
+#define LAYOUT_KEYS (sizeof(layout_keys) / sizeof(struct layout_key))
+
+/**
+ * The XKB keysym names of the printable characters
+ */
+static const struct keysym {
+	const char *name;
+	char chr;
+} keysyms[] = {
+	{ "space", ' ' }, { "exclam", '!' }, { "quotedbl", '"' }, { "numbersign", '#' },
+	{ "dollar", '$' }, { "percent", '%' }, { "ampersand", '&' }, { "apostrophe", '\'' },
+	{ "parenleft", '(' }, { "parenright", ')' }, { "asterisk", '*' }, { "plus", '+' },
+	{ "comma", ',' }, { "minus", '-' }, { "period", '.' }, { "slash", '/' },
+	{ "colon", ':' }, { "semicolon", ';' }, { "less", '<' }, { "equal", '=' },
+	{ "greater", '>' }, { "question", '?' }, { "at", '@' }, { "bracketleft", '[' },
+	{ "backslash", '\\' }, { "bracketright", ']' }, { "asciicircum", '^' }, { "underscore", '_' },
+	{ "grave", '`' }, { "braceleft", '{' }, { "bar", '|' }, { "braceright", '}' },
+	{ "asciitilde", '~' },
+	// Dead keys which type their character when followed by a SPACE, stored negative
+	{ "dead_circumflex", -'^' }, { "dead_grave", -'`' }, { "dead_tilde", -'~' }
+};
+#define KEYSYMS (sizeof(keysyms) / sizeof(struct keysym))
+
+/**
+ * The character on each level of each key, negative for a dead key
+ */
+static int levels[LAYOUT_KEYS][LEVELS];
+
+/**
+ * The include depth each character was defined in, the layout itself wins
+ * over the files it includes
+ */
+static int depths[LAYOUT_KEYS][LEVELS];
+
+/**
+ * Modifier names for each level
+ */
+static const char *level_modifiers[LEVELS] = { "KEY_NONE", "KEY_SHIFT", "KEY_ALTGR", "KEY_ALTGR | KEY_SHIFT" };
+
+/**
+ * Read a whole file into a zero terminated buffer.
+ * UTF-16 files, as KLC files normally are, get all non ASCII characters replaced by 0x01
+ *
+ * @param *filename The file to read
+ * @return The content, must be freed
+ */
+static char *read_file(const char *filename);
+
+/**
+ * Load a section of a XKB symbols file and all its includes into levels[]
+ *
+ * @param *dir The directory with the symbols files
+ * @param *file The symbols file in dir
+ * @param *section The section to load or NULL for the default one
+ * @param depth Include depth to stop include loops
+ */
+static void load_xkb(const char *dir, const char *file, const char *section, int depth);
+
+/**
+ * Load the LAYOUT and DEADKEY sections of a KLC file into levels[]
+ *
+ * @param *filename The KLC file
+ */
+static void load_klc(const char *filename);
+
+/**
+ * Write the layout table and print the coverage report
+ *
+ * @param *out The file to write to
+ * @param *name The name of the layout, like FR
+ * @param *source The source of the layout for the comment
+ * @return Number of characters which can not be typed
+ */
+static int write_layout(FILE *out, const char *name, const char *source);
+
+
+int main(int argc, char **argv) {
+	FILE *out;
+	char *dir, *file, source[512];
+	const char *name, *output;
+
+	// The SPACE and the Non-US key are not always part of the symbols
+	levels[0][0] = levels[0][1] = ' ';
+	levels[LAYOUT_KEYS - 1][0] = '<';
+	levels[LAYOUT_KEYS - 1][1] = '>';
+	depths[0][0] = depths[0][1] = MAX_INCLUDE_DEPTH + 1;
+	depths[LAYOUT_KEYS - 1][0] = depths[LAYOUT_KEYS - 1][1] = MAX_INCLUDE_DEPTH + 1;
+
+	if ((argc == 6) && (strcmp(argv[1], "xkb") == 0)) {
+		dir = strdup(argv[2]);
+		file = strrchr(dir, '/');
+		if (file == NULL) {
+			file = dir;
+			dir = ".";
+		} else {
+			*(file++) = '\0';
+		}
+		load_xkb(dir, file, strcmp(argv[3], "-") ? argv[3] : NULL, 0);
+		snprintf(source, sizeof(source), "XKB %s(%s)", file, argv[3]);
+		name = argv[4];
+		output = argv[5];
+	} else if ((argc == 5) && (strcmp(argv[1], "klc") == 0)) {
+		load_klc(argv[2]);
+		snprintf(source, sizeof(source), "KLC %s", argv[2]);
+		name = argv[3];
+		output = argv[4];
+	} else {
+		fprintf(stderr, "Usage: %s xkb <symbols-file> <variant|-> <NAME> <layout_xx.h>\n", argv[0]);
+		fprintf(stderr, "       %s klc <file.klc> <NAME> <layout_xx.h>\n", argv[0]);
+		return 1;
+	}
+
+	out = fopen(output, "w");
+	if (out == NULL) {
+		perror(output);
+		return 1;
+	}
+	printf("%s: ", output);
+	write_layout(out, name, source);
+	fclose(out);
+	return 0;
+}
+
+/**
+ * Implementation of read_file(const char *filename)
+ */
+static char *read_file(const char *filename) {
+	FILE *in;
+	char *data, *text;
+	long size, pos, len = 0;
+	unsigned int unit;
+
+	in = fopen(filename, "rb");
+	if (in == NULL) {
+		perror(filename);
+		exit(1);
+	}
+	fseek(in, 0, SEEK_END);
+	size = ftell(in);
+	fseek(in, 0, SEEK_SET);
+	data = malloc(size + 1);
+	text = malloc(size + 1);
+	if ((data == NULL) || (text == NULL) || (fread(data, 1, size, in) != (size_t)size)) {
+		perror(filename);
+		exit(1);
+	}
+	fclose(in);
+
+	// UTF-16 little endian with a BOM
+	if ((size >= 2) && ((uint8_t)data[0] == 0xFF) && ((uint8_t)data[1] == 0xFE)) {
+		for (pos = 2; pos + 1 < size; pos += 2) {
+			unit = (uint8_t)data[pos] | ((uint8_t)data[pos + 1] << 8);
+			text[len++] = (unit < 0x80) ? unit : 0x01;
+		}
+	} else {
+		for (pos = 0; pos < size; pos++) {
+			text[len++] = (data[pos] & 0x80) ? 0x01 : data[pos];
+		}
+	}
+	text[len] = '\0';
+	free(data);
+	return text;
+}
+
+/**
+ * Translate a XKB keysym name into a character
+ *
+ * @param *name The keysym name
+ * @param len Length of the name
+ * @return The character, negative for a dead key, 0 if not printable
+ */
+static int xkb_keysym(const char *name, int len) {
+	unsigned int pos;
+	unsigned long code;
+
+	if ((len == 1) && isprint((unsigned char)name[0])) {
+		return name[0];
+	}
+	if ((len > 1) && (name[0] == 'U') && isxdigit((unsigned char)name[1])) {
+		code = strtoul(name + 1, NULL, 16);
+		return ((code > 32) && (code < 127)) ? (int)code : 0;
+	}
+	for (pos = 0; pos < KEYSYMS; pos++) {
+		if ((strlen(keysyms[pos].name) == (size_t)len) && (strncmp(keysyms[pos].name, name, len) == 0)) {
+			return keysyms[pos].chr;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Parse the symbols list of a XKB key definition like "[ 1, exclam, onesuperior ]"
+ *
+ * @param key Position of the key in layout_keys[]
+ * @param *list Start of the list after the '['
+ * @param depth Include depth of the file
+ */
+static void xkb_symbols(int key, const char *list, int depth) {
+	const char *end;
+	int level = 0, len;
+
+	while ((*list != ']') && (*list != '\0') && (level < LEVELS)) {
+		while (isspace((unsigned char)*list)) list++;
+		end = list;
+		while ((*end != ',') && (*end != ']') && (*end != '\0')) end++;
+		len = end - list;
+		while ((len > 0) && isspace((unsigned char)list[len - 1])) len--;
+
+		// NoSymbol keeps what an included section defined
+		if ((len != 8) || (strncmp(list, "NoSymbol", 8) != 0)) {
+			levels[key][level] = xkb_keysym(list, len);
+			depths[key][level] = depth;
+		}
+		level++;
+		list = (*end == ',') ? end + 1 : end;
+	}
+}
+
+/**
+ * Implementation of load_xkb(const char *dir, const char *file, const char *section, int depth)
+ */
+static void load_xkb(const char *dir, const char *file, const char *section, int depth) {
+	char path[512], name[128], include[128], *text, *pos, *body, *end, *sub, *list;
+	const char *before;
+	int braces, key, len;
+
+	if (depth > MAX_INCLUDE_DEPTH) {
+		fprintf(stderr, "%s: includes nested too deep\n", file);
+		exit(1);
+	}
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	text = read_file(path);
+
+	// Remove all comments
+	for (pos = text; *pos; pos++) {
+		if ((pos[0] == '/') && (pos[1] == '/')) {
+			while (*pos && (*pos != '\n')) *(pos++) = ' ';
+			if (!*pos) break;
+		}
+	}
+
+	// Find the section, the first one is used if there is no "default"
+	body = NULL;
+	for (pos = strstr(text, "xkb_symbols"); pos != NULL; pos = strstr(pos + 1, "xkb_symbols")) {
+		if (sscanf(pos, "xkb_symbols \"%127[^\"]\"", name) != 1) {
+			continue;
+		}
+		if (section != NULL) {
+			if (strcmp(name, section) == 0) {
+				body = pos;
+				break;
+			}
+		} else {
+			for (before = pos; (before > text) && (before[-1] != '}'); before--);
+			if (strstr(before, "default") && (strstr(before, "default") < pos)) {
+				body = pos;
+				break;
+			}
+			if (body == NULL) {
+				body = pos;
+			}
+		}
+	}
+	if (body == NULL) {
+		fprintf(stderr, "%s: section '%s' not found\n", path, section ? section : "default");
+		exit(1);
+	}
+
+	// Limit the text to the body of the section
+	body = strchr(body, '{');
+	if (body == NULL) {
+		fprintf(stderr, "%s: broken section\n", path);
+		exit(1);
+	}
+	body++;
+	for (end = body, braces = 1; *end && braces; end++) {
+		if (*end == '{') braces++;
+		if (*end == '}') braces--;
+	}
+	*end = '\0';
+
+	for (pos = body; *pos; pos++) {
+		// Includes are loaded first, the keys after them overwrite them
+		if ((strncmp(pos, "include", 7) == 0) || (strncmp(pos, "augment", 7) == 0)
+			|| (strncmp(pos, "override", 8) == 0) || (strncmp(pos, "replace", 7) == 0)) {
+			sub = strchr(pos, '"');
+			if ((sub == NULL) || (strchr(pos, '\n') < sub)) {
+				continue;
+			}
+			sub++;
+			while (*sub && (*sub != '"')) {
+				len = strcspn(sub, "+|\"");
+				snprintf(include, sizeof(include), "%.*s", len, sub);
+				list = strchr(include, '(');
+				if (list != NULL) {
+					*(list++) = '\0';
+					list[strcspn(list, ")")] = '\0';
+				}
+				if (include[0] != '\0') {
+					load_xkb(dir, include, list, depth + 1);
+				}
+				sub += len;
+				if ((*sub == '+') || (*sub == '|')) sub++;
+			}
+			pos = sub;
+			continue;
+		}
+
+		// key <AE01> { [ 1, exclam ] };
+		if ((strncmp(pos, "key", 3) == 0) && (sscanf(pos, "key <%127[^>]>", name) == 1)) {
+			for (key = 0; key < (int)LAYOUT_KEYS; key++) {
+				if (strcmp(layout_keys[key].xkb, name) == 0) break;
+			}
+			end = strchr(pos, '}');
+			if (end == NULL) break;
+			if (key < (int)LAYOUT_KEYS) {
+				// The first list which is not a [Group1] index or an action
+				for (list = strchr(pos, '['); (list != NULL) && (list < end); list = strchr(list + 1, '[')) {
+					if (strncasecmp(list + 1, "Group", 5) == 0) {
+						continue;
+					}
+					for (before = list - 1; (before > pos) && isspace((unsigned char)*before); before--);
+					if (*before == '=') {
+						for (before--; (before > pos) && (isspace((unsigned char)*before) || (*before == ']')); before--) {
+							if (*before == ']') {
+								while ((before > pos) && (*before != '[')) before--;
+							}
+						}
+						while ((before > pos) && isalpha((unsigned char)before[-1])) before--;
+						if (strncmp(before, "symbols", 7) != 0) {
+							continue;
+						}
+					}
+					xkb_symbols(key, list + 1, depth);
+					break;
+				}
+			}
+			pos = end;
+		}
+	}
+	free(text);
+}
+
+/**
+ * Parse a character of a KLC file like "0021", "!" or "005e@"
+ *
+ * @param *cell The text of the cell
+ * @param *dead Set to 1 if it is a dead key
+ * @return The character or 0 if not printable
+ */
+static int klc_char(const char *cell, int *dead) {
+	int len = strlen(cell);
+	unsigned long code;
+
+	*dead = 0;
+	if ((len > 1) && (cell[len - 1] == '@')) {
+		*dead = 1;
+		len--;
+	}
+	if (len == 1) {
+		code = (uint8_t)cell[0];
+	} else if (len == 4) {
+		code = strtoul(cell, NULL, 16);
+	} else {
+		return 0;
+	}
+	return ((code >= 32) && (code < 127)) ? (int)code : 0;
+}
+
+/**
+ * Implementation of load_klc(const char *filename)
+ */
+static void load_klc(const char *filename) {
+	char *text, *line, *next, *fields[16], *comment;
+	int columns[16], column_count = 0, count, pos, key, chr, dead, level;
+	int dead_chars[LAYOUT_KEYS][LEVELS], space_output[128];
+	enum { KLC_NONE, KLC_SHIFTSTATE, KLC_LAYOUT, KLC_DEADKEY } state = KLC_NONE;
+	int deadkey = 0;
+	unsigned int scancode;
+
+	memset(dead_chars, 0, sizeof(dead_chars));
+	memset(space_output, 0, sizeof(space_output));
+	text = read_file(filename);
+
+	for (line = text; line != NULL; line = next) {
+		next = strpbrk(line, "\r\n");
+		if (next != NULL) {
+			*(next++) = '\0';
+		}
+		comment = strstr(line, "//");
+		if (comment != NULL) {
+			*comment = '\0';
+		}
+
+		// Split the line into fields
+		count = 0;
+		for (fields[0] = strtok(line, " \t"); (fields[count] != NULL) && (count < 15); fields[count] = strtok(NULL, " \t")) {
+			count++;
+		}
+		if (count == 0) {
+			continue;
+		}
+
+		// Sections start with an upper case keyword
+		if (strcmp(fields[0], "SHIFTSTATE") == 0) {
+			state = KLC_SHIFTSTATE;
+			column_count = 0;
+			continue;
+		}
+		if (strcmp(fields[0], "LAYOUT") == 0) {
+			state = KLC_LAYOUT;
+			continue;
+		}
+		if (strcmp(fields[0], "DEADKEY") == 0) {
+			state = KLC_DEADKEY;
+			deadkey = (count > 1) ? klc_char(fields[1], &dead) : 0;
+			continue;
+		}
+		if (isupper((unsigned char)fields[0][0]) && isupper((unsigned char)fields[0][1])) {
+			state = KLC_NONE;
+			continue;
+		}
+
+		switch (state) {
+			// One line per shift state, the order of the columns in LAYOUT
+			case KLC_SHIFTSTATE:
+				if (column_count < 16) {
+					switch (atoi(fields[0])) {
+						case 0: columns[column_count++] = 0; break;
+						case 1: columns[column_count++] = 1; break;
+						case 6: columns[column_count++] = 2; break;
+						case 7: columns[column_count++] = 3; break;
+						default: columns[column_count++] = -1; break;
+					}
+				}
+				break;
+
+			// SC VK Cap Column...
+			case KLC_LAYOUT:
+				if (sscanf(fields[0], "%x", &scancode) != 1) {
+					break;
+				}
+				for (key = 0; key < (int)LAYOUT_KEYS; key++) {
+					if (layout_keys[key].scancode == scancode) break;
+				}
+				if (key == (int)LAYOUT_KEYS) {
+					break;
+				}
+				for (pos = 0; (pos < column_count) && (pos + 3 < count); pos++) {
+					level = columns[pos];
+					if (level < 0) continue;
+					chr = klc_char(fields[pos + 3], &dead);
+					if (dead) {
+						dead_chars[key][level] = chr;
+					} else {
+						levels[key][level] = chr;
+						depths[key][level] = 0;
+					}
+				}
+				break;
+
+			// Pairs of base character and result, only the SPACE is of interest
+			case KLC_DEADKEY:
+				if ((count >= 2) && (deadkey > 0) && (strtoul(fields[0], NULL, 16) == ' ')) {
+					space_output[deadkey] = klc_char(fields[1], &dead);
+				}
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	// Dead keys which type a character with the SPACE
+	for (key = 0; key < (int)LAYOUT_KEYS; key++) {
+		for (level = 0; level < LEVELS; level++) {
+			chr = dead_chars[key][level];
+			if (chr && space_output[chr]) {
+				levels[key][level] = -space_output[chr];
+				depths[key][level] = 0;
+			}
+		}
+	}
+	free(text);
+}
+
+/**
+ * Find the key with the least modifiers for a character.
+ * The Non-US key is only used for characters which need an AltGr otherwise,
+ * not all keyboards have it. On the same level the key defined by the layout
+ * itself is taken before one from an included file.
+ *
+ * @param chr The character, negative to search for a dead key
+ * @param *key Set to the position in layout_keys[]
+ * @param *level Set to the level
+ * @return 1 if found
+ */
+static int find_char(int chr, int *key, int *level) {
+	int pass, pos, keys;
+
+	for (pass = 0; pass < 2; pass++) {
+		keys = pass ? (int)LAYOUT_KEYS : (int)LAYOUT_KEYS - 1;
+		for (*level = 0; *level < (pass ? LEVELS : 2); (*level)++) {
+			*key = -1;
+			for (pos = 0; pos < keys; pos++) {
+				if ((levels[pos][*level] == chr) && ((*key < 0) || (depths[pos][*level] < depths[*key][*level]))) {
+					*key = pos;
+				}
+			}
+			if (*key >= 0) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/**
+ * Implementation of write_layout(FILE *out, const char *name, const char *source)
+ */
+static int write_layout(FILE *out, const char *name, const char *source) {
+	char lower[16], upper[16], dead_list[KEYBOARD_LAYOUT_SIZE * 2 + 1] = "", missing_list[KEYBOARD_LAYOUT_SIZE * 2 + 1] = "";
+	char entry[64], comment[8];
+	int chr, key, level, pos, dead = 0, missing = 0, found = 0;
+
+	for (pos = 0; name[pos] && (pos < (int)sizeof(lower) - 1); pos++) {
+		lower[pos] = tolower((unsigned char)name[pos]);
+		upper[pos] = toupper((unsigned char)name[pos]);
+	}
+	lower[pos] = upper[pos] = '\0';
+
+	fprintf(out, "/**\n");
+	fprintf(out, " * %s Keyboard-Layout\n", upper);
+	fprintf(out, " * Generated by layout_generator from %s\n", source);
+	fprintf(out, " * \n");
+	fprintf(out, " * The USB-Keyboard Scancode and Modifier for each printable character\n");
+	fprintf(out, " * from the SPACE (32) up to DEL (127), see keyboard_layouts[]\n");
+	fprintf(out, " * \n");
+	fprintf(out, " * @author Lukas Zurschmiede <l.zurschmiede@ranta.ch>\n");
+	fprintf(out, " * @package teensy_keyboard\n");
+	fprintf(out, " * @license GPL-v3\n");
+	fprintf(out, " */\n\n");
+	fprintf(out, "#ifndef LAYOUT_%s_H\n", upper);
+	fprintf(out, "#define LAYOUT_%s_H\n\n", upper);
+	fprintf(out, "static const uint8_t PROGMEM layout_%s[KEYBOARD_LAYOUT_SIZE][2] = {\n", lower);
+
+	for (chr = KEYBOARD_LAYOUT_FIRST; chr < KEYBOARD_LAYOUT_FIRST + KEYBOARD_LAYOUT_SIZE; chr++) {
+		if (chr == 127) {
+			snprintf(entry, sizeof(entry), "{ KEY_NONE, KEY_NONE },");
+			snprintf(comment, sizeof(comment), "DEL");
+		} else {
+			if (find_char(chr, &key, &level)) {
+				snprintf(entry, sizeof(entry), "{ %s, %s },", layout_keys[key].name, level_modifiers[level]);
+				found++;
+			} else if (find_char(-chr, &key, &level)) {
+				snprintf(entry, sizeof(entry), "{ %s, %s | KEY_DEAD },", layout_keys[key].name, level_modifiers[level]);
+				sprintf(dead_list + strlen(dead_list), " %c", chr);
+				dead++;
+			} else {
+				snprintf(entry, sizeof(entry), "{ KEY_NONE, KEY_NONE },");
+				sprintf(missing_list + strlen(missing_list), " %c", chr);
+				missing++;
+			}
+			if ((chr == '\'') || (chr == '\\')) {
+				snprintf(comment, sizeof(comment), "'\\%c'", chr);
+			} else {
+				snprintf(comment, sizeof(comment), "'%c'", chr);
+			}
+		}
+		fprintf(out, "\t%s", entry);
+		for (pos = 8 + strlen(entry); pos < 48; pos = (pos + 8) & ~7) {
+			fputc('\t', out);
+		}
+		fprintf(out, "// %s\n", comment);
+	}
+	fprintf(out, "};\n\n#endif\n");
+
+	// The coverage report
+	printf("%d characters direct, %d with a dead key, %d unreachable\n", found, dead, missing);
+	if (dead) {
+		printf("  dead key, followed by a SPACE:%s\n", dead_list);
+	}
+	if (missing) {
+		printf("  unreachable:%s\n", missing_list);
+	}
+	return missing;
+}
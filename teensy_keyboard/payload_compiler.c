@@ -0,0 +1,1103 @@
+/**
+ * Host tool which compiles a payload script into the bytecode executed by
+ * the teensy. All parsing is done here and every character is checked
+ * against the keyboard_layouts[], so the teensy only has to fetch and
+ * dispatch the precompiled opcodes.
+ *
+ * For the bytecode format see the OP_* definitions in keyboard_payload.h
+ *
+ * With -r the strings are rendered into the reports the teensy sends, with
+ * the same releases in between as type_key(), so the teensy only copies
+ * them into the queue and does not look up anything. A character which
+ * can not be typed with the layout is an error then, not a warning.
+ * The rendered reports all go to the first keyboard interface.
+ *
+ * With -z the bytecode is compressed with LZSS, the teensy decompresses
+ * it while reading, see stream_read() in keyboard_payload.c.
+ *
+ * The subroutines, the repeated blocks and the strings typed more than once
+ * are moved into the payload_pool, which is never compressed, and the
+ * payload only calls them there with OP_CALL.
+ *
+ * Several scripts can be given, each one is compiled into its own slot of
+ * the payload and the teensy selects one of them at boot, see
+ * select_slot() in keyboard_payload.c. The pool is shared by all slots.
+ *
+ * @author Lukas Zurschmiede <l.zurschmiede@ranta.ch>
+ * @version 0.1
+ * @package teensy_keyboard
+ * @license GPL-v3
+ */
+
+/* License:
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/**
+ * The Makefile builds and runs this tool before the firmware, by hand:
+ * shell> gcc payload_compiler.c -o payload_compiler
+ * shell> ./payload_compiler [-r] [-z] payload.txt [payload2.txt...] payload_data.h
+ */
+
+#define PAYLOAD_COMPILER
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "config.h"
+#include "keyboard_payload.h"
+
+/**
+ * Maximum number of keys in one 'K' command, the keyboard sends all of
+ * them with the NKRO report, but only six in the boot protocol
+ */
+#define MAX_CHORD_KEYS 16
+
+/**
+ * The compiled bytecode, written out as payload_data.h at the end
+ */
+static uint8_t *code = NULL;
+static unsigned long code_size = 0, code_alloc = 0;
+
+/**
+ * The subroutines, repeated blocks and strings used more than once, called
+ * with OP_CALL and ending with OP_RETURN, written as payload_pool
+ */
+static uint8_t *pool = NULL;
+static unsigned long pool_size = 0;
+
+/**
+ * Maximum length of the name of a subroutine
+ */
+#define MAX_NAME 32
+
+/**
+ * The subroutines and repeated blocks being compiled, one in the other:
+ * the command which started it, where its bytecode starts, how often it
+ * is repeated and the deepest OP_CALL nesting in it so far
+ */
+static struct {
+	int cmd, line, count, depth;
+	unsigned long start;
+	char name[MAX_NAME];
+} blocks[PAYLOAD_STACK_DEPTH];
+static int block_count = 0;
+
+/**
+ * The subroutines defined so far, their address in the pool and how deep
+ * the OP_CALL are nested with them
+ */
+static struct subroutine {
+	char name[MAX_NAME];
+	unsigned long address;
+	int depth;
+} *subroutines = NULL;
+static int subroutine_count = 0;
+
+/**
+ * The bytecode of all strings, the first time they are kept in the
+ * payload, from the second time on they are called in the pool, address
+ * is -1 before
+ */
+static struct string {
+	uint8_t *code;
+	unsigned long size;
+	long address;
+} *strings = NULL;
+static int string_count = 0;
+
+/**
+ * The script being compiled and its current line, used for the warnings
+ */
+static const char *source_name = NULL;
+static int line_number = 0;
+
+/**
+ * The bytecode of all slots one after the other, written as payload, and
+ * where each slot starts in it, written as payload_slots
+ */
+static uint8_t *slots_code = NULL;
+static unsigned long slots_size = 0;
+static unsigned long slot_start[PAYLOAD_SLOTS_MAX];
+static int slot_count = 0;
+
+/**
+ * Keys to send as Keystrokes, set by parse_char() and parse_special()
+ */
+static int press_key = 0, press_modifier = 0;
+
+/**
+ * Render the strings into OP_REPORTS, set with -r, and compress the
+ * bytecode, set with -z
+ */
+static int render = 0, compress = 0;
+
+/**
+ * Size of the bytecode of all slots before it was compressed
+ */
+static unsigned long uncompressed_size = 0;
+
+/**
+ * The key and modifier of the last rendered report, see render_key()
+ */
+static int rendered_key, rendered_modifier;
+
+/**
+ * The layout active at the current line, changed with the 'M' command.
+ * Selecting it with the LAYOUT_JUMPER can not be known here.
+ */
+static int layout = DEFAULT_LAYOUT;
+
+/**
+ * Names of the layouts for the 'M' command, in the order of the LAYOUT_* numbers
+ */
+static const char *layout_names[LAYOUT_COUNT] = { "US", "CH", "DE", "FR", "UK", "SE", "NO", "DK" };
+
+/**
+ * Append one byte to the bytecode
+ *
+ * @param byte The byte to append
+ */
+static void emit(uint8_t byte);
+
+/**
+ * Append one rendered report with only the given key and modifier
+ * pressed to the OP_REPORTS at count_pos, or start a new one if it is
+ * full or there is none yet
+ *
+ * @param key The USB-Keyboard Scancode or KEY_NONE
+ * @param modifier The modifier keys
+ * @param *count_pos Position of the number of reports in the code, 0 if there is none
+ */
+static void render_report(int key, int modifier, unsigned long *count_pos);
+
+/**
+ * Render a typed key the same way type_key() in keyboard_payload.c sends it:
+ * a release is only sent in between if the same key is typed again or the
+ * modifier changes.
+ *
+ * @param key The USB-Keyboard Scancode
+ * @param modifier The modifier keys
+ * @param *count_pos Position of the number of reports in the code, see render_report()
+ */
+static void render_key(int key, int modifier, unsigned long *count_pos);
+
+/**
+ * Compile one line of the script, see README.md for the commands.
+ *
+ * Lines with an unknown command character are ignored, so a '#' can be
+ * used to write comments.
+ *
+ * @param *line The line without the trailing newline
+ */
+static void compile_line(char *line);
+
+/**
+ * Look up a single character in the current layout and set press_key and press_modifier.
+ * press_key is KEY_NONE if the character can not be typed.
+ *
+ * @param chr The character to translate
+ */
+static void parse_char(int chr);
+
+/**
+ * Parse the milliseconds of a wait, limited to 65535
+ *
+ * @param *str The string with the number
+ * @return The milliseconds
+ */
+static unsigned long parse_timeout(const char *str);
+
+/**
+ * Parse a special key, defined at the first and second position of an array of chars
+ * and sets the global press_key and press_modifier.
+ *
+ * Special Keys are:
+ *   Ctrl, Alt, Win, Shift, Del, Home, Insert, ENd, EScape, SPace, SYsrq, Return, ENter, TAb
+ *
+ * @param *str Pointer to the CharArray to parse
+ * @param modifier The current Modifier key to apply all others to
+ */
+static void parse_special(char *str, int *modifier);
+
+/**
+ * Stop with an error if the lock key of a command switches the FLOW_CONTROL_LED
+ * of config.h: the host echoes the LED and the keyboard would pause itself
+ *
+ * @param led The KEYBOARD_LED_* the command toggles
+ */
+static void check_flow_control(int led);
+
+/**
+ * Move the bytecode from the given position to the end into the pool,
+ * followed by an OP_RETURN, and remove it from the code
+ *
+ * @param start Position of the first byte to move
+ * @return The address in the pool
+ */
+static unsigned long move_to_pool(unsigned long start);
+
+/**
+ * Append an OP_CALL and count the depth of the nested calls
+ *
+ * @param address The address in the pool
+ * @param count How often it is executed, 1-255
+ * @param depth How deep the calls are nested in the called block, 1 without other calls
+ */
+static void emit_call(unsigned long address, int count, int depth);
+
+/**
+ * Start a subroutine with the 'F' command or a repeated block with the 'N'
+ * command, or end it if there is no name or count
+ *
+ * @param cmd The command, 'F' or 'N'
+ * @param *arg The name of the subroutine or how often to repeat the block
+ */
+static void compile_block(int cmd, const char *arg);
+
+/**
+ * A string typed before is called in the pool instead. The bytecode of the
+ * string from the given position on is replaced by the OP_CALL from the
+ * second time on, it is only worth it if the string is longer than that.
+ *
+ * @param start Position of the first byte of the string's bytecode
+ */
+static void intern_string(unsigned long start);
+
+/**
+ * Compress the bytecode with LZSS, the format is described at stream_read()
+ * in keyboard_payload.c: the longest match in the last 256 bytes is taken
+ * if it has at least 3 bytes, otherwise a literal byte. The build fails if
+ * it does not decompress to the same bytecode again.
+ */
+static void compress_code(void);
+
+/**
+ * Decompress the compressed bytecode the same way stream_read() in
+ * keyboard_payload.c does, with the same 8 bit counters, so compress_code()
+ * can check that the teensy reads back what was compiled
+ *
+ * @param *out Buffer for the decompressed bytecode
+ * @param size Number of bytes to decompress
+ * @return 0 if the compressed bytecode ends too early
+ */
+static int decompress_code(uint8_t *out, unsigned long size);
+
+/**
+ * Compile a script into the next slot, each slot starts with the
+ * DEFAULT_LAYOUT and has its own subroutines, the pool is shared
+ *
+ * @param *source Name of the script
+ */
+static void compile_script(const char *source);
+
+/**
+ * Write the bytecode of all slots as a C-Header
+ *
+ * @param *out The file to write to
+ * @param **sources Names of the scripts, only for the comments in the header
+ */
+static void write_header(FILE *out, char **sources);
+
+
+int main(int argc, char **argv) {
+	FILE *out;
+	int i;
+
+	while ((argc > 3) && (argv[1][0] == '-')) {
+		if (strcmp(argv[1], "-r") == 0) {
+			render = 1;
+		} else if (strcmp(argv[1], "-z") == 0) {
+			compress = 1;
+		} else {
+			break;
+		}
+		argc--;
+		argv++;
+	}
+	if ((argc < 3) || (argc > PAYLOAD_SLOTS_MAX + 2)) {
+		fprintf(stderr, "Usage: %s [-r] [-z] <payload.txt>... <payload_data.h>\n", argv[0]);
+		fprintf(stderr, "Each script is one slot, at most %d\n", PAYLOAD_SLOTS_MAX);
+		return 1;
+	}
+
+	for (i = 1; i < argc - 1; i++) {
+		compile_script(argv[i]);
+	}
+	if (slots_size > 65535) {
+		fprintf(stderr, "%s: the payload has more than 65535 bytes\n", argv[argc - 1]);
+		return 1;
+	}
+
+	out = fopen(argv[argc - 1], "w");
+	if (out == NULL) {
+		perror(argv[argc - 1]);
+		return 1;
+	}
+	write_header(out, argv + 1);
+	fclose(out);
+
+	if (compress) {
+		printf("%s: %lu bytes of bytecode, compressed to %lu bytes\n", argv[argc - 1], uncompressed_size, slots_size);
+	} else {
+		printf("%s: %lu bytes of bytecode\n", argv[argc - 1], slots_size);
+	}
+	return 0;
+}
+
+/**
+ * Implementation of compile_script(const char *source)
+ */
+static void compile_script(const char *source) {
+	FILE *in;
+	char line[4096];
+	size_t len;
+
+	in = fopen(source, "r");
+	if (in == NULL) {
+		perror(source);
+		exit(1);
+	}
+	source_name = source;
+	line_number = 0;
+	layout = DEFAULT_LAYOUT;
+	subroutine_count = 0;
+	code_size = 0;
+	while (fgets(line, sizeof(line), in) != NULL) {
+		line_number++;
+		len = strlen(line);
+		if ((len == sizeof(line) - 1) && (line[len - 1] != '\n')) {
+			fprintf(stderr, "%s:%d: line too long\n", source, line_number);
+			exit(1);
+		}
+		while ((len > 0) && ((line[len - 1] == '\n') || (line[len - 1] == '\r'))) {
+			line[--len] = '\0';
+		}
+		compile_line(line);
+	}
+	fclose(in);
+	if (block_count) {
+		fprintf(stderr, "%s:%d: the block started with '%c' is not closed\n", source, blocks[block_count - 1].line, blocks[block_count - 1].cmd);
+		exit(1);
+	}
+	emit(OP_END);
+	uncompressed_size += code_size;
+	if (compress) {
+		// Each slot on its own, the teensy starts decompressing at its start
+		compress_code();
+	}
+
+	slots_code = realloc(slots_code, slots_size + code_size);
+	if (slots_code == NULL) {
+		perror("realloc");
+		exit(1);
+	}
+	memcpy(slots_code + slots_size, code, code_size);
+	slot_start[slot_count++] = slots_size;
+	slots_size += code_size;
+}
+
+/**
+ * Implementation of emit(uint8_t byte)
+ */
+static void emit(uint8_t byte) {
+	if (code_size == code_alloc) {
+		code_alloc = code_alloc ? code_alloc * 2 : 1024;
+		code = realloc(code, code_alloc);
+		if (code == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	code[code_size++] = byte;
+}
+
+/**
+ * Implementation of move_to_pool(unsigned long start)
+ */
+static unsigned long move_to_pool(unsigned long start) {
+	unsigned long address = pool_size, size = code_size - start;
+
+	if (pool_size + size + 1 > 65536) {
+		fprintf(stderr, "%s:%d: the pool is full\n", source_name, line_number);
+		exit(1);
+	}
+	pool = realloc(pool, pool_size + size + 1);
+	if (pool == NULL) {
+		perror("realloc");
+		exit(1);
+	}
+	memcpy(pool + pool_size, code + start, size);
+	pool_size += size;
+	pool[pool_size++] = OP_RETURN;
+	code_size = start;
+	return address;
+}
+
+/**
+ * Implementation of emit_call(unsigned long address, int count, int depth)
+ */
+static void emit_call(unsigned long address, int count, int depth) {
+	emit(OP_CALL);
+	emit(address & 0xFF);
+	emit(address >> 8);
+	emit(count);
+	if (block_count && (blocks[block_count - 1].depth < depth)) {
+		blocks[block_count - 1].depth = depth;
+	}
+	if (depth + block_count > PAYLOAD_STACK_DEPTH) {
+		fprintf(stderr, "%s:%d: more than %d calls nested\n", source_name, line_number, PAYLOAD_STACK_DEPTH);
+		exit(1);
+	}
+}
+
+/**
+ * Implementation of compile_block(int cmd, const char *arg)
+ */
+static void compile_block(int cmd, const char *arg) {
+	unsigned long address;
+	int count = 1, depth, i;
+
+	// Start a new block
+	if (*arg != '\0') {
+		if (cmd == 'N') {
+			count = atoi(arg);
+			if ((count < 1) || (count > 255)) {
+				fprintf(stderr, "%s:%d: a block can be repeated 1 to 255 times\n", source_name, line_number);
+				exit(1);
+			}
+		} else if (strlen(arg) >= MAX_NAME) {
+			fprintf(stderr, "%s:%d: the name '%s' is too long\n", source_name, line_number, arg);
+			exit(1);
+		}
+		if (block_count == PAYLOAD_STACK_DEPTH) {
+			fprintf(stderr, "%s:%d: more than %d blocks nested\n", source_name, line_number, PAYLOAD_STACK_DEPTH);
+			exit(1);
+		}
+		blocks[block_count].cmd = cmd;
+		blocks[block_count].line = line_number;
+		blocks[block_count].count = count;
+		blocks[block_count].depth = 0;
+		blocks[block_count].start = code_size;
+		strcpy(blocks[block_count].name, (cmd == 'F') ? arg : "");
+		block_count++;
+		return;
+	}
+
+	// End the block, the subroutine is only called where 'G' is used
+	if (!block_count || (blocks[block_count - 1].cmd != cmd)) {
+		fprintf(stderr, "%s:%d: '%c' ends no block\n", source_name, line_number, cmd);
+		exit(1);
+	}
+	block_count--;
+	address = move_to_pool(blocks[block_count].start);
+	depth = blocks[block_count].depth + 1;
+	if (cmd == 'N') {
+		emit_call(address, blocks[block_count].count, depth);
+		return;
+	}
+	for (i = 0; i < subroutine_count; i++) {
+		if (strcmp(subroutines[i].name, blocks[block_count].name) == 0) {
+			fprintf(stderr, "%s:%d: the subroutine '%s' is already defined\n", source_name, line_number, subroutines[i].name);
+			exit(1);
+		}
+	}
+	subroutines = realloc(subroutines, (subroutine_count + 1) * sizeof(struct subroutine));
+	if (subroutines == NULL) {
+		perror("realloc");
+		exit(1);
+	}
+	strcpy(subroutines[subroutine_count].name, blocks[block_count].name);
+	subroutines[subroutine_count].address = address;
+	subroutines[subroutine_count].depth = depth;
+	subroutine_count++;
+}
+
+/**
+ * Implementation of intern_string(unsigned long start)
+ */
+static void intern_string(unsigned long start) {
+	unsigned long size = code_size - start;
+	int i;
+
+	if (size <= 4) {
+		return;
+	}
+	for (i = 0; i < string_count; i++) {
+		if ((strings[i].size == size) && (memcmp(strings[i].code, code + start, size) == 0)) {
+			break;
+		}
+	}
+	if (i == string_count) {
+		strings = realloc(strings, (string_count + 1) * sizeof(struct string));
+		if (strings == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+		strings[i].code = malloc(size);
+		if (strings[i].code == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+		memcpy(strings[i].code, code + start, size);
+		strings[i].size = size;
+		strings[i].address = -1;
+		string_count++;
+		return;
+	}
+	if (strings[i].address < 0) {
+		strings[i].address = move_to_pool(start);
+	}
+	code_size = start;
+	emit_call(strings[i].address, 1, 1);
+}
+
+/**
+ * Implementation of render_report(int key, int modifier, unsigned long *count_pos)
+ */
+static void render_report(int key, int modifier, unsigned long *count_pos) {
+	if ((*count_pos == 0) || (code[*count_pos] == 255)) {
+		emit(OP_REPORTS);
+		*count_pos = code_size;
+		emit(0);
+		emit(0);
+	}
+	emit(modifier);
+	emit(key);
+	code[*count_pos]++;
+	rendered_key = key;
+	rendered_modifier = modifier;
+}
+
+/**
+ * Implementation of render_key(int key, int modifier, unsigned long *count_pos)
+ */
+static void render_key(int key, int modifier, unsigned long *count_pos) {
+	if ((key == rendered_key) || (modifier != rendered_modifier)) {
+		render_report(KEY_NONE, modifier, count_pos);
+	}
+	render_report(key, modifier, count_pos);
+}
+
+/**
+ * Implementation of compile_line(char *line)
+ */
+static void compile_line(char *line) {
+	char *send = line, *token;
+	int cmd = *(send++), modifier, count, pos, led;
+	unsigned long timeout, count_pos, start;
+	uint8_t keys[MAX_CHORD_KEYS];
+
+	// Skip the ":" after the command and all whitespaces
+	if (*send == ':') {
+		send++;
+	}
+	while (*send == ' ') {
+		send++;
+	}
+
+	switch (cmd) {
+		// Modifier and up to MAX_CHORD_KEYS keys pressed together
+		case 'K':
+		case 'k':
+			switch (*send) {
+				case 'W':
+				case 'w':
+					modifier = KEY_GUI;
+					break;
+				case 'S':
+				case 's':
+					modifier = KEY_SHIFT;
+					break;
+				case 'C':
+				case 'c':
+					modifier = KEY_CTRL;
+					break;
+				case 'A':
+				case 'a':
+					modifier = KEY_ALT;
+					break;
+				default:
+					modifier = KEY_NONE;
+			}
+
+			count = 0;
+			strtok(send, " ");
+			while ((token = strtok(NULL, " ")) != NULL) {
+				// Check for F1-F12, a special key made of at least 2 chars or a normal key
+				press_key = KEY_NONE;
+				if (((token[0] == 'f') || (token[0] == 'F')) && (token[1] > '0') && (token[1] <= '9')) {
+					if ((token[1] == '1') && (token[2] >= '0') && (token[2] <= '2')) {
+						press_key = KEY_F10 + (token[2] - '0');
+					} else {
+						press_key = KEY_F1 + (token[1] - '1');
+					}
+				} else if (token[1] != '\0') {
+					parse_special(token, &modifier);
+				} else {
+					parse_char(token[0]);
+				}
+
+				if (press_key == KEY_NONE) {
+					continue;
+				}
+				if (count >= MAX_CHORD_KEYS) {
+					fprintf(stderr, "%s:%d: more than %d keys, '%s' ignored\n", source_name, line_number, MAX_CHORD_KEYS, token);
+					continue;
+				}
+				if (count == 6) {
+					fprintf(stderr, "%s:%d: more than six keys only work if the host uses the report protocol\n", source_name, line_number);
+				}
+				keys[count++] = press_key;
+			}
+
+			emit(OP_CHORD);
+			emit(modifier);
+			emit(count);
+			for (pos = 0; pos < count; pos++) {
+				emit(keys[pos]);
+			}
+			break;
+
+		// Write a string, a TYPE opcode can hold up to 255 characters
+		case 'S':
+		case 's':
+			start = code_size;
+			count = 0;
+			count_pos = 0;
+			rendered_key = rendered_modifier = KEY_NONE;
+			for (; *send != '\0'; send++) {
+				if (((uint8_t)*send < KEYBOARD_LAYOUT_FIRST) || ((uint8_t)*send >= KEYBOARD_LAYOUT_FIRST + KEYBOARD_LAYOUT_SIZE)) {
+					fprintf(stderr, "%s:%d: character 0x%02x can not be typed%s\n", source_name, line_number, (uint8_t)*send, render ? "" : ", ignored");
+					if (render) {
+						exit(1);
+					}
+					continue;
+				}
+				parse_char(*send);
+				if (press_key == KEY_NONE) {
+					fprintf(stderr, "%s:%d: character '%c' can not be typed with the layout %s\n", source_name, line_number, *send, layout_names[layout]);
+					if (render) {
+						exit(1);
+					}
+				}
+				if (render) {
+					// A dead key only types its character together with the next one
+					render_key(press_key, press_modifier & ~KEY_DEAD, &count_pos);
+					if (press_modifier & KEY_DEAD) {
+						render_key(KEY_SPACE, KEY_NONE, &count_pos);
+					}
+					// Counted in the OP_REPORTS it ends in, at most one for each report
+					code[count_pos + 1]++;
+					continue;
+				}
+				if ((count == 0) || (count == 255)) {
+					emit(OP_TYPE);
+					count_pos = code_size;
+					emit(0);
+					count = 0;
+				}
+				emit(*send);
+				code[count_pos] = ++count;
+			}
+			if (render && ((rendered_key != KEY_NONE) || (rendered_modifier != KEY_NONE))) {
+				render_report(KEY_NONE, KEY_NONE, &count_pos);
+			}
+			intern_string(start);
+			break;
+
+		// Wait for the given amount of milliseconds
+		case 'W':
+		case 'w':
+			timeout = parse_timeout(send);
+			emit(OP_WAIT);
+			emit(timeout & 0xFF);
+			emit(timeout >> 8);
+			break;
+
+		// Continue here after a bus reset, not at the start of the last line
+		case 'P':
+		case 'p':
+			if (block_count) {
+				fprintf(stderr, "%s:%d: a checkpoint can not be in a block\n", source_name, line_number);
+				exit(1);
+			}
+			emit(OP_CHECKPOINT);
+			break;
+
+		// Subroutines and repeated blocks, they end on a line without a name or count
+		case 'F':
+		case 'f':
+		case 'N':
+		case 'n':
+			compile_block(cmd & ~0x20, send);
+			if (*send || (cmd & ~0x20) == 'F') {
+				return;
+			}
+			break;
+
+		// Call a subroutine
+		case 'G':
+		case 'g':
+			for (pos = 0; pos < subroutine_count; pos++) {
+				if (strcmp(subroutines[pos].name, send) == 0) {
+					break;
+				}
+			}
+			if (pos == subroutine_count) {
+				fprintf(stderr, "%s:%d: unknown subroutine '%s'\n", source_name, line_number, send);
+				exit(1);
+			}
+			emit_call(subroutines[pos].address, 1, subroutines[pos].depth);
+			break;
+
+		// Find the fastest typing speed the host can handle
+		case 'C':
+		case 'c':
+			check_flow_control(KEYBOARD_LED_NUM_LOCK);
+			timeout = parse_timeout(send);
+			emit(OP_CALIBRATE);
+			emit(timeout & 0xFF);
+			emit(timeout >> 8);
+			break;
+
+		// Toggle a lock key twice and wait each time until the host switches the LED
+		case 'Q':
+		case 'q':
+			switch (*send) {
+				case 'C':
+				case 'c':
+					press_key = KEY_CAPS_LOCK;
+					led = KEYBOARD_LED_CAPS_LOCK;
+					break;
+				case 'S':
+				case 's':
+					press_key = KEY_SCROLL_LOCK;
+					led = KEYBOARD_LED_SCROLL_LOCK;
+					break;
+				default:
+					press_key = KEY_NUM_LOCK;
+					led = KEYBOARD_LED_NUM_LOCK;
+			}
+			check_flow_control(led);
+			emit(OP_SYNC);
+			emit(press_key);
+			emit(led);
+			timeout = parse_timeout(send);
+			emit(timeout & 0xFF);
+			emit(timeout >> 8);
+			break;
+
+		// Single keystrokes
+		case 'X':
+		case 'x':
+		case 'E':
+		case 'e':
+		case 'T':
+		case 't':
+		case 'U':
+		case 'u':
+		case 'D':
+		case 'd':
+		case 'L':
+		case 'l':
+		case 'R':
+		case 'r':
+			switch (cmd | 0x20) {
+				case 'x': press_key = KEY_ESC; break;
+				case 'e': press_key = KEY_ENTER; break;
+				case 't': press_key = KEY_TAB; break;
+				case 'u': press_key = KEY_UP; break;
+				case 'd': press_key = KEY_DOWN; break;
+				case 'l': press_key = KEY_LEFT; break;
+				default:  press_key = KEY_RIGHT; break;
+			}
+			emit(OP_CHORD);
+			emit(KEY_NONE);
+			emit(1);
+			emit(press_key);
+			break;
+
+		// Switch the layout
+		case 'M':
+		case 'm':
+			for (pos = 0; pos < LAYOUT_COUNT; pos++) {
+				if (strcasecmp(send, layout_names[pos]) == 0) {
+					break;
+				}
+			}
+			if (pos == LAYOUT_COUNT) {
+				fprintf(stderr, "%s:%d: unknown layout '%s'\n", source_name, line_number, send);
+				exit(1);
+			}
+			layout = pos;
+			emit(OP_LAYOUT);
+			emit(layout);
+			break;
+
+		// Empty lines and comments
+		default:
+			return;
+	}
+	// Only the payload itself continues at the lines after a bus reset
+	if (!block_count) {
+		emit(OP_EOL);
+	}
+}
+
+/**
+ * Implementation of parse_timeout(const char *str)
+ */
+static unsigned long parse_timeout(const char *str) {
+	unsigned long timeout = 0;
+
+	for (; *str != '\0'; str++) {
+		if ((*str >= '0') && (*str <= '9')) {
+			timeout = timeout * 10 + (*str - '0');
+			if (timeout > 0xFFFF) {
+				fprintf(stderr, "%s:%d: wait limited to 65535 milliseconds\n", source_name, line_number);
+				return 0xFFFF;
+			}
+		}
+	}
+	return timeout;
+}
+
+/**
+ * Implementation of parse_char(int chr)
+ */
+static void parse_char(int chr) {
+	press_key = KEY_NONE;
+	press_modifier = KEY_NONE;
+	if ((chr >= KEYBOARD_LAYOUT_FIRST) && (chr < KEYBOARD_LAYOUT_FIRST + KEYBOARD_LAYOUT_SIZE)) {
+		press_key = keyboard_layouts[layout][chr - KEYBOARD_LAYOUT_FIRST][0];
+		press_modifier = keyboard_layouts[layout][chr - KEYBOARD_LAYOUT_FIRST][1];
+	}
+}
+
+/**
+ * Implementation of check_flow_control(int led)
+ */
+static void check_flow_control(int led) {
+#ifdef FLOW_CONTROL_LED
+	if (led & FLOW_CONTROL_LED) {
+		fprintf(stderr, "%s:%d: the lock key switches the FLOW_CONTROL_LED and would pause the keyboard\n", source_name, line_number);
+		exit(1);
+	}
+#endif
+}
+
+/**
+ * Implementation of parse_special(char *str, int *modifier)
+ */
+static void parse_special(char *str, int *modifier) {
+	int next = str[1] | 0x20;
+
+	press_key = KEY_NONE;
+	switch (*str) {
+		case 'A':
+		case 'a':
+			*modifier = *modifier | KEY_ALT;
+			break;
+		case 'D':
+		case 'd':
+			press_key = KEY_DELETE;
+			break;
+		case 'C':
+		case 'c':
+			*modifier = *modifier | KEY_CTRL;
+			break;
+		case 'E':
+		case 'e':
+			if (next == 's') {
+				press_key = KEY_ESC;
+			} else if ((next == 'n') && ((str[2] | 0x20) == 'd')) {
+				press_key = KEY_END;
+			} else {
+				press_key = KEY_ENTER;
+			}
+			break;
+		case 'H':
+		case 'h':
+			press_key = KEY_HOME;
+			break;
+		case 'I':
+		case 'i':
+			press_key = KEY_INSERT;
+			break;
+		case 'P':
+		case 'p':
+			press_key = KEY_PRINTSCREEN;
+			break;
+		case 'R':
+		case 'r':
+			press_key = KEY_ENTER;
+			break;
+		case 'S':
+		case 's':
+			if (next == 'p') {
+				press_key = KEY_SPACE;
+			} else if (next == 'y') {
+				press_key = KEY_PRINTSCREEN;
+			} else {
+				*modifier = *modifier | KEY_SHIFT;
+			}
+			break;
+		case 'T':
+		case 't':
+			press_key = KEY_TAB;
+			break;
+		case 'W':
+		case 'w':
+			press_key = SKEY_GUI;
+			break;
+	}
+}
+
+/**
+ * Implementation of compress_code(void)
+ */
+static void compress_code(void) {
+	uint8_t *in = code, *out;
+	unsigned long size = code_size, pos = 0, flag_pos = 0, start, length, best, best_start = 0;
+	int items = 8;
+
+	code = NULL;
+	code_size = code_alloc = 0;
+	while (pos < size) {
+		if (items == 8) {
+			flag_pos = code_size;
+			emit(0);
+			items = 0;
+		}
+		// The longest match in the last 256 bytes, it may overlap the position
+		best = 0;
+		// and stream_read() counts it down from at most 255
+		for (start = (pos > 256) ? pos - 256 : 0; start < pos; start++) {
+			for (length = 0; (length < 255) && (pos + length < size) && (in[start + length] == in[pos + length]); length++);
+			if (length > best) {
+				best = length;
+				best_start = start;
+			}
+		}
+		if (best >= 3) {
+			emit(pos - best_start - 1);
+			emit(best - 3);
+			pos += best;
+		} else {
+			code[flag_pos] |= 1 << items;
+			emit(in[pos++]);
+		}
+		items++;
+	}
+
+	// Better no payload than one the teensy types wrong
+	out = malloc(size);
+	if (out == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	if (!decompress_code(out, size) || memcmp(in, out, size)) {
+		fprintf(stderr, "%s: the compressed payload does not decompress to the bytecode\n", source_name);
+		exit(1);
+	}
+	free(out);
+	free(in);
+}
+
+/**
+ * Implementation of decompress_code(uint8_t *out, unsigned long size)
+ */
+static int decompress_code(uint8_t *out, unsigned long size) {
+	uint8_t ring[256], ring_pos = 0, match = 0, match_length = 0;
+	unsigned long pos = 0, cursor = 0;
+	uint16_t flags = 1;
+
+	while (pos < size) {
+		if (!match_length) {
+			if (flags == 1) {
+				if (cursor >= code_size) {
+					return 0;
+				}
+				flags = 0x100 | code[cursor++];
+			}
+			if (flags & 1) {
+				flags >>= 1;
+				if (cursor >= code_size) {
+					return 0;
+				}
+				out[pos] = ring[ring_pos++] = code[cursor++];
+				pos++;
+				continue;
+			}
+			flags >>= 1;
+			if (cursor + 1 >= code_size) {
+				return 0;
+			}
+			match = ring_pos - code[cursor++] - 1;
+			match_length = code[cursor++] + 3;
+		}
+		out[pos] = ring[ring_pos++] = ring[match++];
+		match_length--;
+		pos++;
+	}
+	return 1;
+}
+
+/**
+ * Implementation of write_header(FILE *out, char **sources)
+ */
+static void write_header(FILE *out, char **sources) {
+	unsigned long pos;
+	int i;
+
+	fprintf(out, "// Generated by payload_compiler, do not edit\n");
+	if (compress) {
+		fprintf(out, "// Compressed with LZSS from %lu bytes, see stream_read()\n", uncompressed_size);
+		fprintf(out, "#define PAYLOAD_COMPRESSED\n");
+	}
+	fprintf(out, "#define PAYLOAD_SIZE %lu\n\n", slots_size);
+	fprintf(out, "static const uint8_t PROGMEM payload[PAYLOAD_SIZE] = {");
+	for (pos = 0; pos < slots_size; pos++) {
+		fprintf(out, "%s0x%02x,", (pos % 16) ? " " : "\n\t", slots_code[pos]);
+	}
+	fprintf(out, "\n};\n\n");
+
+	fprintf(out, "#define PAYLOAD_SLOTS %d\n\n", slot_count);
+	fprintf(out, "static const uint16_t PROGMEM payload_slots[PAYLOAD_SLOTS] = {\n");
+	for (i = 0; i < slot_count; i++) {
+		fprintf(out, "\t%lu, // %d: %s\n", slot_start[i], i, sources[i]);
+	}
+	fprintf(out, "};\n\n");
+
+	// An empty array is not allowed, the pool has at least an OP_RETURN
+	if (pool_size == 0) {
+		code_size = 0;
+		move_to_pool(0);
+	}
+	fprintf(out, "#define PAYLOAD_POOL_SIZE %lu\n\n", pool_size);
+	fprintf(out, "static const uint8_t PROGMEM payload_pool[PAYLOAD_POOL_SIZE] = {");
+	for (pos = 0; pos < pool_size; pos++) {
+		fprintf(out, "%s0x%02x,", (pos % 16) ? " " : "\n\t", pool[pos]);
+	}
+	fprintf(out, "\n};\n");
+}
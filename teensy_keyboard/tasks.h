@@ -0,0 +1,46 @@
+/**
+ * Stackless tasks which run beside the payload
+ *
+ * A task is a function which is called again and again, each time the
+ * payload sleeps, so at least once each USB frame, and continues after the
+ * TASK_YIELD... where it returned the last time, like the protothreads of
+ * Adam Dunkels. It only needs the 4 bytes of struct task in the RAM and no
+ * stack of its own, so its local variables are lost at a TASK_YIELD... and
+ * have to be static.
+ * The macros are the cases of a switch, a task can not use them inside
+ * another switch and not twice in the same line.
+ *
+ * @author Lukas Zurschmiede <l.zurschmiede@ranta.ch>
+ * @package teensy_keyboard
+ * @license GPL-v3
+ */
+
+#ifndef TASKS_H
+#define TASKS_H
+
+#include <stdint.h>
+
+/**
+ * The line the task continues at, 0 at the start, and the frame it sleeps until
+ */
+struct task {
+	uint16_t line;
+	uint16_t wake;
+};
+
+#define TASK_BEGIN(t)  switch ((t)->line) { case 0:
+#define TASK_END(t)    } (t)->line = 0
+
+// Return and continue here the next time
+#define TASK_YIELD(t)  do { (t)->line = __LINE__; return; case __LINE__: ; } while (0)
+
+// Return until the condition is true, it is checked each time the task is called
+#define TASK_YIELD_UNTIL(t, condition) do { (t)->line = __LINE__; case __LINE__: if (!(condition)) return; } while (0)
+
+// Return for the given number of frames
+#define TASK_SLEEP(t, frames) do { \
+		(t)->wake = usb_frame_clock() + (frames); \
+		TASK_YIELD_UNTIL(t, (int16_t)(usb_frame_clock() - (t)->wake) >= 0); \
+	} while (0)
+
+#endif
@@ -25,7 +25,9 @@
 // Version 1.1: Add support for Teensy 2.0
 
 #define USB_SERIAL_PRIVATE_INCLUDE
+#include <stddef.h>
 #include "usb_keyboard.h"
+#include "bench.h"
 
 /**************************************************************************
  *
@@ -61,18 +63,32 @@
  *
  **************************************************************************/
 
-#define ENDPOINT0_SIZE		32
+#define ENDPOINT0_SIZE		64
 
 #define KEYBOARD_INTERFACE	0
 #define KEYBOARD_ENDPOINT	3
-#define KEYBOARD_SIZE		8
+#define KEYBOARD2_INTERFACE	1
+#define KEYBOARD2_ENDPOINT	4
+#define KEYBOARD_SIZE		16
 #define KEYBOARD_BUFFER		EP_DOUBLE_BUFFER
 
+// the endpoint of each keyboard interface
+#define KEYBOARD_ENDPOINT_OF(n)	((n) ? KEYBOARD2_ENDPOINT : KEYBOARD_ENDPOINT)
+
+// Number of reports usb_keyboard_send() can queue up while the
+// start-of-frame interrupt transmits one per frame, a power of 2
+// and KEYBOARD_SIZE bytes of RAM each.
+#define KEYBOARD_QUEUE_SIZE	32
+
 static const uint8_t PROGMEM endpoint_config_table[] = {
 	0,
 	0,
 	1, EP_TYPE_INTERRUPT_IN,  EP_SIZE(KEYBOARD_SIZE) | KEYBOARD_BUFFER,
+#if KEYBOARD_INTERFACES > 1
+	1, EP_TYPE_INTERRUPT_IN,  EP_SIZE(KEYBOARD_SIZE) | KEYBOARD_BUFFER
+#else
 	0
+#endif
 };
 
 
@@ -107,6 +123,10 @@ static const uint8_t PROGMEM device_descriptor[] = {
 };
 
 // Keyboard Protocol 1, HID 1.11 spec, Appendix B, page 59-60
+// In report protocol the six key array is replaced by a bitmap with
+// one bit for each key, so any number of keys can be down at once.
+// The host sets the boot protocol if it does not parse this descriptor
+// (like a BIOS), then the first 8 bytes are sent in the boot layout.
 static const uint8_t PROGMEM keyboard_hid_report_desc[] = {
         0x05, 0x01,          // Usage Page (Generic Desktop),
         0x09, 0x06,          // Usage (Keyboard),
@@ -131,26 +151,34 @@ static const uint8_t PROGMEM keyboard_hid_report_desc[] = {
         0x95, 0x01,          //   Report Count (1),
         0x75, 0x03,          //   Report Size (3),
         0x91, 0x03,          //   Output (Constant),                 ;LED report padding
-        0x95, 0x06,          //   Report Count (6),
-        0x75, 0x08,          //   Report Size (8),
+        0x95, 0x70,          //   Report Count (112),
+        0x75, 0x01,          //   Report Size (1),
         0x15, 0x00,          //   Logical Minimum (0),
-        0x25, 0x68,          //   Logical Maximum(104),
+        0x25, 0x01,          //   Logical Maximum (1),
         0x05, 0x07,          //   Usage Page (Key Codes),
         0x19, 0x00,          //   Usage Minimum (0),
-        0x29, 0x68,          //   Usage Maximum (104),
-        0x81, 0x00,          //   Input (Data, Array),
+        0x29, 0x6F,          //   Usage Maximum (111),
+        0x81, 0x02,          //   Input (Data, Variable, Absolute), ;Key bitmap
+        0x06, 0x00, 0xFF,    //   Usage Page (Vendor Defined),
+        0x09, 0x01,          //   Usage (1),
+        0x15, 0x00,          //   Logical Minimum (0),
+        0x26, 0xFF, 0x00,    //   Logical Maximum (255),
+        0x75, 0x08,          //   Report Size (8),
+        0x95, sizeof(struct keyboard_stats_struct), //   Report Count,
+        0xB1, 0x03,          //   Feature (Constant, Variable, Absolute), ;Counters
         0xc0                 // End Collection
 };
 
-#define CONFIG1_DESC_SIZE        (9+9+9+7)
+#define CONFIG1_DESC_SIZE        (9+(9+9+7)*KEYBOARD_INTERFACES)
 #define KEYBOARD_HID_DESC_OFFSET (9+9)
+#define KEYBOARD2_HID_DESC_OFFSET (9+9+9+7+9)
 static const uint8_t PROGMEM config1_descriptor[CONFIG1_DESC_SIZE] = {
 	// configuration descriptor, USB spec 9.6.3, page 264-266, Table 9-10
 	9, 					// bLength;
 	2,					// bDescriptorType;
 	LSB(CONFIG1_DESC_SIZE),			// wTotalLength
 	MSB(CONFIG1_DESC_SIZE),
-	1,					// bNumInterfaces
+	KEYBOARD_INTERFACES,			// bNumInterfaces
 	1,					// bConfigurationValue
 	0,					// iConfiguration
 	0xC0,					// bmAttributes
@@ -180,16 +208,44 @@ static const uint8_t PROGMEM config1_descriptor[CONFIG1_DESC_SIZE] = {
 	KEYBOARD_ENDPOINT | 0x80,		// bEndpointAddress
 	0x03,					// bmAttributes (0x03=intr)
 	KEYBOARD_SIZE, 0,			// wMaxPacketSize
-	1					// bInterval
+	1,					// bInterval
+#if KEYBOARD_INTERFACES > 1
+	// the second keyboard, the same as the first one
+	9,					// bLength
+	4,					// bDescriptorType
+	KEYBOARD2_INTERFACE,			// bInterfaceNumber
+	0,					// bAlternateSetting
+	1,					// bNumEndpoints
+	0x03,					// bInterfaceClass (0x03 = HID)
+	0x01,					// bInterfaceSubClass (0x01 = Boot)
+	0x01,					// bInterfaceProtocol (0x01 = Keyboard)
+	0,					// iInterface
+	9,					// bLength
+	0x21,					// bDescriptorType
+	0x11, 0x01,				// bcdHID
+	0,					// bCountryCode
+	1,					// bNumDescriptors
+	0x22,					// bDescriptorType
+	sizeof(keyboard_hid_report_desc),	// wDescriptorLength
+	0,
+	7,					// bLength
+	5,					// bDescriptorType
+	KEYBOARD2_ENDPOINT | 0x80,		// bEndpointAddress
+	0x03,					// bmAttributes (0x03=intr)
+	KEYBOARD_SIZE, 0,			// wMaxPacketSize
+	1,					// bInterval
+#endif
 };
 
 // If you're desperate for a little extra code memory, these strings
 // can be completely removed if iManufacturer, iProduct, iSerialNumber
 // in the device desciptor are changed to zeros.
+// The strings are wchar_t, 16 bits on the AVR and on the host of
+// "make check" with -fshort-wchar.
 struct usb_string_descriptor_struct {
 	uint8_t bLength;
 	uint8_t bDescriptorType;
-	int16_t wString[];
+	wchar_t wString[];
 };
 static const struct usb_string_descriptor_struct PROGMEM string0 = {
 	4,
@@ -208,22 +264,30 @@ static const struct usb_string_descriptor_struct PROGMEM string2 = {
 };
 
 // This table defines which descriptor data is sent for each specific
-// request from the host (in wValue and wIndex).
+// request from the host.  The position in the table is computed out of
+// the request by usb_descriptor_index(), so there is nothing to search.
 static const struct descriptor_list_struct {
-	uint16_t	wValue;
-	uint16_t	wIndex;
 	const uint8_t	*addr;
 	uint8_t		length;
 } PROGMEM descriptor_list[] = {
-	{0x0100, 0x0000, device_descriptor, sizeof(device_descriptor)},
-	{0x0200, 0x0000, config1_descriptor, sizeof(config1_descriptor)},
-	{0x2200, KEYBOARD_INTERFACE, keyboard_hid_report_desc, sizeof(keyboard_hid_report_desc)},
-	{0x2100, KEYBOARD_INTERFACE, config1_descriptor+KEYBOARD_HID_DESC_OFFSET, 9},
-	{0x0300, 0x0000, (const uint8_t *)&string0, 4},
-	{0x0301, 0x0409, (const uint8_t *)&string1, sizeof(STR_MANUFACTURER)},
-	{0x0302, 0x0409, (const uint8_t *)&string2, sizeof(STR_PRODUCT)}
+	{device_descriptor, sizeof(device_descriptor)},
+	{config1_descriptor, sizeof(config1_descriptor)},
+	{(const uint8_t *)&string0, 4},
+	{(const uint8_t *)&string1, sizeof(STR_MANUFACTURER)},
+	{(const uint8_t *)&string2, sizeof(STR_PRODUCT)},
+	{config1_descriptor+KEYBOARD_HID_DESC_OFFSET, 9},
+	{keyboard_hid_report_desc, sizeof(keyboard_hid_report_desc)},
+#if KEYBOARD_INTERFACES > 1
+	{config1_descriptor+KEYBOARD2_HID_DESC_OFFSET, 9},
+	{keyboard_hid_report_desc, sizeof(keyboard_hid_report_desc)},
+#endif
 };
 #define NUM_DESC_LIST (sizeof(descriptor_list)/sizeof(struct descriptor_list_struct))
+#define DESC_DEVICE	0	// the device descriptor
+#define DESC_CONFIG	1	// the configuration descriptor
+#define DESC_STRING	2	// the three strings, 0 is the language
+#define DESC_STRINGS	3
+#define DESC_HID	5	// the HID and report descriptor of each interface
 
 
 /**************************************************************************
@@ -235,29 +299,91 @@ static const struct descriptor_list_struct {
 // zero when we are not configured, non-zero when enumerated
 static volatile uint8_t usb_configuration=0;
 
+// counts the start of frames, one each millisecond
+static volatile uint16_t usb_frame_count=0;
+
+// counts the bus resets, the queue and the configuration are gone
+static volatile uint8_t usb_reset_count=0;
+
+// non-zero while the host has suspended the bus, the USB clock is
+// stopped then and nothing is sent until the bus resumes
+static volatile uint8_t usb_suspend=0;
+
 // which modifier keys are currently pressed
 // 1=left ctrl,    2=left shift,   4=left alt,    8=left gui
 // 16=right ctrl, 32=right shift, 64=right alt, 128=right gui
 uint8_t keyboard_modifier_keys=0;
 
-// which keys are currently pressed, up to 6 keys may be down at once
-uint8_t keyboard_keys[6]={0,0,0,0,0,0};
+// which keys are currently pressed, one bit for each key code,
+// use usb_keyboard_key_down() to set them
+uint8_t keyboard_key_bitmap[KEYBOARD_BITMAP_SIZE];
 
-// protocol setting from the host.  We use exactly the same report
-// either way, so this variable only stores the setting since we
-// are required to be able to report which setting is in use.
-static uint8_t keyboard_protocol=1;
+// protocol setting from the host for each interface.  1=report
+// protocol, we send the key bitmap.  0=boot protocol, we send the
+// first 6 keys of the bitmap in the 8 byte boot report.
+static uint8_t keyboard_protocol[KEYBOARD_INTERFACES];
 
 // the idle configuration, how often we send the report to the
 // host (ms * 4) even when it hasn't changed
-static uint8_t keyboard_idle_config=125;
+static uint8_t keyboard_idle_config[KEYBOARD_INTERFACES];
 
 // count until idle timeout
-static uint8_t keyboard_idle_count=0;
+static uint8_t keyboard_idle_count[KEYBOARD_INTERFACES];
 
 // 1=num lock, 2=caps lock, 4=scroll lock, 8=compose, 16=kana
 volatile uint8_t keyboard_leds=0;
 
+// reports waiting for the host, filled by usb_keyboard_send() at
+// the head and transmitted by the start-of-frame interrupt from
+// the tail, the queue is empty when both are the same.  The flags
+// hold the interface and KEYBOARD_SAME_FRAME for each report.
+static uint8_t keyboard_queue[KEYBOARD_QUEUE_SIZE][KEYBOARD_SIZE];
+static uint8_t keyboard_queue_flags[KEYBOARD_QUEUE_SIZE];
+static uint8_t keyboard_queue_frame[KEYBOARD_QUEUE_SIZE];
+static volatile uint8_t keyboard_queue_head=0;
+static volatile uint8_t keyboard_queue_tail=0;
+
+// the counters for the host, see struct keyboard_stats_struct
+static volatile struct keyboard_stats_struct keyboard_stats;
+
+// the report last sent to the host on each interface, for the
+// idle timeout, and the interface of the last report sent
+static uint8_t keyboard_report[KEYBOARD_INTERFACES][KEYBOARD_SIZE];
+static uint8_t keyboard_report_interface=0;
+
+// empty frames between two reports, set by usb_keyboard_set_gap()
+// for hosts which lose keystrokes at full speed, and the frames
+// left until the next report may be sent
+static uint8_t keyboard_report_gap=0;
+static volatile uint8_t keyboard_gap_count=0;
+
+// how often the host has changed keyboard_leds
+static volatile uint8_t keyboard_led_change_count=0;
+
+// the KEYBOARD_READY_* events seen since the last bus reset
+static volatile uint8_t keyboard_ready_events=0;
+
+// a control transfer which continues in the next endpoint 0 interrupt,
+// so the interrupt does not wait for the host in between
+#define CONTROL_IDLE		0	// waiting for the next setup packet
+#define CONTROL_DATA_IN		1	// sending control_addr to the host
+#define CONTROL_SET_ADDRESS	2	// status stage sent, then set the address
+#define CONTROL_SET_REPORT	3	// waiting for the LEDs in the data stage
+static uint8_t control_state=CONTROL_IDLE;
+static const uint8_t *control_addr;
+static uint8_t control_length;
+static uint8_t control_address;
+
+// the LED the host toggles to stop and restart sending the queued
+// reports, 0 without flow control, see usb_keyboard_flow_control()
+static uint8_t keyboard_flow_led=0;
+static volatile uint8_t keyboard_flow_paused=0;
+
+static uint8_t usb_keyboard_transmit(void);
+static inline void usb_keyboard_count_wait(uint8_t frames);
+static inline void usb_count_cycles(uint16_t start);
+static void usb_keyboard_write_report(uint8_t interface);
+
 
 /**************************************************************************
  *
@@ -269,6 +395,8 @@ volatile uint8_t keyboard_leds=0;
 // initialize USB
 void usb_init(void)
 {
+	uint8_t i;
+
 	HW_CONFIG();
 	USB_FREEZE();	// enable USB
 	PLL_CONFIG();				// config PLL
@@ -276,7 +404,14 @@ void usb_init(void)
 	USB_CONFIG();				// start USB clock
 	UDCON = 0;				// enable attach resistor
 	usb_configuration = 0;
-	UDIEN = (1<<EORSTE)|(1<<SOFE);
+	for (i=0; i<KEYBOARD_INTERFACES; i++) {
+		keyboard_protocol[i] = 1;
+		keyboard_idle_config[i] = 125;
+	}
+	UDIEN = (1<<EORSTE)|(1<<SOFE)|(1<<SUSPE);
+	// timer 1 runs with the CPU clock to measure the interrupts
+	TCCR1A = 0;
+	TCCR1B = (1<<CS10);
 	sei();
 }
 
@@ -288,54 +423,236 @@ uint8_t usb_configured(void)
 }
 
 
+// how often the bus was reset, each reset empties the queue and
+// the host has to configure us again, it wraps around after 255
+uint8_t usb_resets(void)
+{
+	return usb_reset_count;
+}
+
+// non-zero while the bus is suspended, the frame clock stands still
+// and the queued reports wait for the bus to resume
+uint8_t usb_suspended(void)
+{
+	return usb_suspend;
+}
+
+// milliseconds since the host started sending frames, as
+// counted by the start-of-frame interrupt, it wraps around
+// after 65535 so use the difference of two values
+uint16_t usb_frame_clock(void)
+{
+	uint8_t intr_state;
+	uint16_t count;
+
+	intr_state = SREG;
+	cli();
+	count = usb_frame_count;
+	SREG = intr_state;
+	return count;
+}
+
 // perform a single keystroke
 int8_t usb_keyboard_press(uint8_t key, uint8_t modifier)
 {
 	int8_t r;
 
+	usb_keyboard_release_all();
 	keyboard_modifier_keys = modifier;
-	keyboard_keys[0] = key;
+	usb_keyboard_key_down(key);
 	r = usb_keyboard_send();
 	if (r) return r;
-	keyboard_modifier_keys = 0;
-	keyboard_keys[0] = 0;
+	usb_keyboard_release_all();
 	return usb_keyboard_send();
 }
 
-// send the contents of keyboard_keys and keyboard_modifier_keys
+// mark a key as pressed in keyboard_key_bitmap, the modifier
+// key codes 224-231 are set in keyboard_modifier_keys
+void usb_keyboard_key_down(uint8_t key)
+{
+	if (key >= 224 && key <= 231) {
+		keyboard_modifier_keys |= (1 << (key - 224));
+	} else if (key && key < KEYBOARD_BITMAP_SIZE * 8) {
+		keyboard_key_bitmap[key >> 3] |= (1 << (key & 7));
+	}
+}
+
+// release all keys and modifiers
+void usb_keyboard_release_all(void)
+{
+	uint8_t i;
+
+	keyboard_modifier_keys = 0;
+	for (i=0; i<KEYBOARD_BITMAP_SIZE; i++) {
+		keyboard_key_bitmap[i] = 0;
+	}
+}
+
+// queue the contents of keyboard_key_bitmap and keyboard_modifier_keys,
+// this only waits if the queue is full
 int8_t usb_keyboard_send(void)
 {
-	uint8_t i, intr_state, timeout;
+	uint8_t timeout;
+	int8_t r;
+
+	timeout = UDFNUML + 50;
+	while ((r = usb_keyboard_send_on(KEYBOARD_INTERFACE)) > 0) {
+		// have we waited too long?
+		if (UDFNUML == timeout) {
+			keyboard_stats.full_waits++;
+			return -1;
+		}
+	}
+	return r;
+}
+
+// the same as usb_keyboard_send() but on the given interface, with
+// KEYBOARD_SAME_FRAME the report can reach the host together with
+// the report queued before, in any order.  it never waits: on a
+// full queue it returns 1 and the caller tries again after the next
+// interrupt, while the host has paused us as long as it wants
+int8_t usb_keyboard_send_on(uint8_t flags)
+{
+	uint8_t i, intr_state, head;
+	uint8_t *report;
 
 	if (!usb_configuration) return -1;
 	intr_state = SREG;
 	cli();
-	UENUM = KEYBOARD_ENDPOINT;
-	timeout = UDFNUML + 50;
-	while (1) {
-		// are we ready to transmit?
-		if (UEINTX & (1<<RWAL)) break;
+	// is there space in the queue?
+	head = (keyboard_queue_head + 1) & (KEYBOARD_QUEUE_SIZE - 1);
+	if (head == keyboard_queue_tail) {
 		SREG = intr_state;
-		// has the USB gone offline?
-		if (!usb_configuration) return -1;
-		// have we waited too long?
-		if (UDFNUML == timeout) return -1;
-		// get ready to try checking again
-		intr_state = SREG;
-		cli();
-		UENUM = KEYBOARD_ENDPOINT;
+		// the bus is suspended, the caller has to wait for the
+		// resume and send it again, nothing is lost
+		if (usb_suspend) return -1;
+		return 1;
 	}
-	UEDATX = keyboard_modifier_keys;
-	UEDATX = 0;
-	for (i=0; i<6; i++) {
-		UEDATX = keyboard_keys[i];
+	report = keyboard_queue[keyboard_queue_head];
+	report[0] = keyboard_modifier_keys;
+	report[1] = 0;
+	for (i=0; i<KEYBOARD_BITMAP_SIZE; i++) {
+		report[i+2] = keyboard_key_bitmap[i];
 	}
-	UEINTX = 0x3A;
-	keyboard_idle_count = 0;
+	keyboard_queue_flags[keyboard_queue_head] = flags;
+	keyboard_queue_frame[keyboard_queue_head] = usb_frame_count;
+	keyboard_queue_head = head;
+	i = (head - keyboard_queue_tail) & (KEYBOARD_QUEUE_SIZE - 1);
+	if (i > keyboard_stats.queue_high) keyboard_stats.queue_high = i;
+	// if the endpoint is idle, don't wait for the next frame
+	usb_keyboard_transmit();
 	SREG = intr_state;
 	return 0;
 }
 
+// leave the given number of empty frames between two reports
+void usb_keyboard_set_gap(uint8_t frames)
+{
+	keyboard_report_gap = frames;
+}
+
+// let the host pause sending the queued reports by toggling the
+// given KEYBOARD_LED_* and continue by toggling it again, like
+// XOFF and XON, 0 turns it off
+void usb_keyboard_flow_control(uint8_t led)
+{
+	uint8_t intr_state;
+
+	intr_state = SREG;
+	cli();
+	keyboard_flow_led = led;
+	keyboard_flow_paused = 0;
+	SREG = intr_state;
+}
+
+// is sending paused by the host, see usb_keyboard_flow_control()
+uint8_t usb_keyboard_paused(void)
+{
+	return keyboard_flow_paused;
+}
+
+// how often the host has changed keyboard_leds, it wraps around
+// after 255 so use the difference of two values
+uint8_t usb_keyboard_led_changes(void)
+{
+	return keyboard_led_change_count;
+}
+
+// which KEYBOARD_READY_* events the host has caused since the
+// last bus reset, to know when its driver is listening
+uint8_t usb_keyboard_ready(void)
+{
+	return keyboard_ready_events;
+}
+
+// number of reports in the queue, not yet sent to the host
+uint8_t usb_keyboard_queue_depth(void)
+{
+	return (keyboard_queue_head - keyboard_queue_tail) & (KEYBOARD_QUEUE_SIZE - 1);
+}
+
+// number of reports written into the endpoints, it wraps around
+// after 65535 so use the difference of two values
+uint16_t usb_keyboard_sent(void)
+{
+	uint8_t intr_state;
+	uint16_t count;
+
+	intr_state = SREG;
+	cli();
+	count = keyboard_stats.sent;
+	SREG = intr_state;
+	return count;
+}
+
+// number of reports the host has taken, the ones written into the
+// endpoints but still in their banks are not, like usb_keyboard_sent()
+// it wraps around after 65535
+uint16_t usb_keyboard_taken(void)
+{
+	uint8_t intr_state, i;
+	uint16_t count;
+
+	intr_state = SREG;
+	cli();
+	count = keyboard_stats.sent;
+	if (usb_configuration) {
+		for (i=0; i<KEYBOARD_INTERFACES; i++) {
+			UENUM = KEYBOARD_ENDPOINT_OF(i);
+			count -= UESTA0X & 0x03;
+		}
+	}
+	SREG = intr_state;
+	return count;
+}
+
+// count a report which found the queue full for 50 frames and is
+// sent again later, for the counters read by the host
+void usb_keyboard_count_retry(void)
+{
+	uint8_t intr_state;
+
+	intr_state = SREG;
+	cli();
+	keyboard_stats.full_waits++;
+	keyboard_stats.retries++;
+	SREG = intr_state;
+}
+
+// how often a report found the queue full for 50 frames, nothing
+// is lost, the caller waited and sent it again
+uint16_t usb_keyboard_full_waits(void)
+{
+	uint8_t intr_state;
+	uint16_t count;
+
+	intr_state = SREG;
+	cli();
+	count = keyboard_stats.full_waits;
+	SREG = intr_state;
+	return count;
+}
+
 /**************************************************************************
  *
  *  Private Functions - not intended for general user consumption....
@@ -343,6 +660,83 @@ int8_t usb_keyboard_send(void)
  **************************************************************************/
 
 
+// move the oldest queued report into its endpoint, must be called
+// with interrupts disabled.  Returns 1 if a report was sent and 0 if
+// the queue is empty or the report has to wait.
+//
+// The host polls each endpoint once a frame, but in no defined order,
+// so a report on one interface may only be sent when all reports on
+// the other interfaces were taken by the host.  A report flagged with
+// KEYBOARD_SAME_FRAME may overtake the one queued before it.
+static uint8_t usb_keyboard_transmit(void)
+{
+	uint8_t i, tail, flags, interface;
+
+	tail = keyboard_queue_tail;
+	if (tail == keyboard_queue_head) return 0;
+	if (keyboard_gap_count || keyboard_flow_paused || usb_suspend) return 0;
+	flags = keyboard_queue_flags[tail];
+	interface = flags & KEYBOARD_INTERFACE_MASK;
+	if (interface >= KEYBOARD_INTERFACES) interface = KEYBOARD_INTERFACE;
+#if KEYBOARD_INTERFACES > 1
+	for (i=0; i<KEYBOARD_INTERFACES; i++) {
+		if (i == interface) continue;
+		UENUM = KEYBOARD_ENDPOINT_OF(i);
+		// number of banks still waiting for the host
+		if ((UESTA0X & 0x03) > (((flags & KEYBOARD_SAME_FRAME)
+		  && i == keyboard_report_interface) ? 1 : 0)) return 0;
+	}
+#endif
+	UENUM = KEYBOARD_ENDPOINT_OF(interface);
+	if (!(UEINTX & (1<<RWAL))) return 0;
+	BENCH_ON(BENCH_PIN_REPORT);
+	for (i=0; i<KEYBOARD_SIZE; i++) {
+		keyboard_report[interface][i] = keyboard_queue[tail][i];
+	}
+	usb_keyboard_write_report(interface);
+	UEINTX = 0x3A;
+	BENCH_OFF(BENCH_PIN_REPORT);
+	keyboard_queue_tail = (tail + 1) & (KEYBOARD_QUEUE_SIZE - 1);
+	keyboard_stats.sent++;
+	usb_keyboard_count_wait((uint8_t)usb_frame_count - keyboard_queue_frame[tail]);
+	keyboard_idle_count[interface] = 0;
+	keyboard_report_interface = interface;
+	if (keyboard_report_gap) keyboard_gap_count = keyboard_report_gap + 1;
+	return 1;
+}
+
+// write the last report of an interface into the selected endpoint in
+// the format of the protocol the host has selected, in boot protocol
+// more than 6 keys are reported as ErrorRollOver (1) like a real
+// keyboard does
+static void usb_keyboard_write_report(uint8_t interface)
+{
+	uint8_t i, n, bits, key, keys[6];
+	const uint8_t *report = keyboard_report[interface];
+
+	UEDATX = report[0];
+	UEDATX = 0;
+	if (keyboard_protocol[interface]) {
+		for (i=2; i<KEYBOARD_SIZE; i++) {
+			UEDATX = report[i];
+		}
+		return;
+	}
+	n = 0;
+	for (i=2; i<KEYBOARD_SIZE; i++) {
+		bits = report[i];
+		for (key = (i - 2) * 8; bits; key++, bits >>= 1) {
+			if (!(bits & 1)) continue;
+			if (n < 6) keys[n] = key;
+			n++;
+		}
+	}
+	for (i=0; i<6; i++) {
+		if (n > 6) UEDATX = 1;
+		else UEDATX = (i < n) ? keys[i] : 0;
+	}
+}
+
 
 // USB Device Interrupt - handle all device-level events
 // the transmit buffer flushing is triggered by the start of frame
@@ -350,35 +744,104 @@ int8_t usb_keyboard_send(void)
 ISR(USB_GEN_vect)
 {
 	uint8_t intbits, t, i;
+	uint16_t start;
 	static uint8_t div4=0;
 
+	start = TCNT1;
+	BENCH_ON(BENCH_PIN_USB_GEN);
         intbits = UDINT;
+	if ((intbits & (1<<WAKEUPI)) && usb_suspend) {
+		// start the clock again, the flags can't be cleared without
+		PLL_CONFIG();
+		while (!(PLLCSR & (1<<PLOCK))) ;
+		USB_CONFIG();
+		UDIEN = (1<<EORSTE)|(1<<SOFE)|(1<<SUSPE);
+		usb_suspend = 0;
+		intbits &= ~(1<<SUSPI);
+	}
         UDINT = 0;
+	if ((intbits & (1<<SUSPI)) && !usb_suspend) {
+		// no frames for 3 ms, stop the clock and the PLL to use
+		// less power, until the host wakes us up again
+		UDIEN = (1<<EORSTE)|(1<<WAKEUPE);
+		usb_suspend = 1;
+		USB_FREEZE();
+		PLLCSR = 0;
+		BENCH_OFF(BENCH_PIN_USB_GEN);
+		return;
+	}
         if (intbits & (1<<EORSTI)) {
 		UENUM = 0;
 		UECONX = 1;
 		UECFG0X = EP_TYPE_CONTROL;
 		UECFG1X = EP_SIZE(ENDPOINT0_SIZE) | EP_SINGLE_BUFFER;
 		UEIENX = (1<<RXSTPE);
+		control_state = CONTROL_IDLE;
 		usb_configuration = 0;
+		usb_reset_count++;
+		keyboard_ready_events = 0;
+		keyboard_flow_paused = 0;
+		keyboard_queue_tail = keyboard_queue_head;
         }
+	if (intbits & (1<<SOFI)) {
+		usb_frame_count++;
+		if (keyboard_gap_count) keyboard_gap_count--;
+	}
 	if ((intbits & (1<<SOFI)) && usb_configuration) {
-		if (keyboard_idle_config && (++div4 & 3) == 0) {
+		// the endpoint answers NAK to the host's first poll as long
+		// as nothing is queued, which sets NAKINI without interrupt
+		if (!(keyboard_ready_events & KEYBOARD_READY_POLL)) {
 			UENUM = KEYBOARD_ENDPOINT;
-			if (UEINTX & (1<<RWAL)) {
-				keyboard_idle_count++;
-				if (keyboard_idle_count == keyboard_idle_config) {
-					keyboard_idle_count = 0;
-					UEDATX = keyboard_modifier_keys;
-					UEDATX = 0;
-					for (i=0; i<6; i++) {
-						UEDATX = keyboard_keys[i];
-					}
+			if (UEINTX & (1<<NAKINI)) {
+				keyboard_ready_events |= KEYBOARD_READY_POLL;
+				UEINTX = ~(1<<NAKINI);
+			}
+		}
+		// fill the free endpoint banks with the queued reports,
+		// the idle timeout only counts while nothing is waiting
+		if (keyboard_queue_tail != keyboard_queue_head) {
+			while (usb_keyboard_transmit()) ;
+			// still a report left the host could have now
+			if (keyboard_queue_tail != keyboard_queue_head
+			  && !keyboard_gap_count && !keyboard_flow_paused) {
+				keyboard_stats.bank_wait++;
+			}
+		} else if ((++div4 & 3) == 0) {
+			for (i=0; i<KEYBOARD_INTERFACES; i++) {
+				if (!keyboard_idle_config[i]) continue;
+				UENUM = KEYBOARD_ENDPOINT_OF(i);
+				if (!(UEINTX & (1<<RWAL))) continue;
+				keyboard_idle_count[i]++;
+				if (keyboard_idle_count[i] == keyboard_idle_config[i]) {
+					keyboard_idle_count[i] = 0;
+					usb_keyboard_write_report(i);
 					UEINTX = 0x3A;
 				}
 			}
 		}
 	}
+	usb_count_cycles(start);
+	BENCH_OFF(BENCH_PIN_USB_GEN);
+}
+
+// remember the longest interrupt, started at the given TCNT1
+static inline void usb_count_cycles(uint16_t start)
+{
+	uint16_t cycles = TCNT1 - start;
+
+	if (cycles > keyboard_stats.isr_cycles) keyboard_stats.isr_cycles = cycles;
+}
+
+// count a report in the histogram by the frames it was queued
+static inline void usb_keyboard_count_wait(uint8_t frames)
+{
+	uint8_t i=0, limit=0;
+
+	while (frames > limit && i < KEYBOARD_STATS_WAITS - 1) {
+		i++;
+		limit = limit ? limit << 1 : 1;
+	}
+	keyboard_stats.waits[i]++;
 }
 
 
@@ -392,10 +855,6 @@ static inline void usb_send_in(void)
 {
 	UEINTX = ~(1<<TXINI);
 }
-static inline void usb_wait_receive_out(void)
-{
-	while (!(UEINTX & (1<<RXOUTI))) ;
-}
 static inline void usb_ack_out(void)
 {
 	UEINTX = ~(1<<RXOUTI);
@@ -407,24 +866,122 @@ static inline void usb_ack_out(void)
 // other endpoints are manipulated by the user-callable
 // functions, and the start-of-frame interrupt.
 //
+static inline void usb_control_request(void);
 ISR(USB_COM_vect)
+{
+	uint16_t start;
+
+	start = TCNT1;
+	BENCH_ON(BENCH_PIN_USB_COM);
+	usb_control_request();
+	usb_count_cycles(start);
+	BENCH_OFF(BENCH_PIN_USB_COM);
+}
+
+// the position of the requested descriptor in descriptor_list,
+// or NUM_DESC_LIST if there is no such descriptor
+static inline uint8_t usb_descriptor_index(uint16_t wValue, uint16_t wIndex)
+{
+	uint8_t index = wValue;
+
+	switch (wValue >> 8) {
+	  case 0x01:
+		if (index == 0) return DESC_DEVICE;
+		break;
+	  case 0x02:
+		if (index == 0) return DESC_CONFIG;
+		break;
+	  case 0x03:
+		if (index < DESC_STRINGS) return DESC_STRING + index;
+		break;
+	  case 0x21:
+		if (index == 0 && wIndex < KEYBOARD_INTERFACES) return DESC_HID + wIndex * 2;
+		break;
+	  case 0x22:
+		if (index == 0 && wIndex < KEYBOARD_INTERFACES) return DESC_HID + wIndex * 2 + 1;
+		break;
+	}
+	return NUM_DESC_LIST;
+}
+
+// the control transfer is over, wait for the next setup packet
+static inline void usb_control_done(void)
+{
+	control_state = CONTROL_IDLE;
+	UEIENX = (1<<RXSTPE);
+}
+
+// continue the control transfer in control_state, each time the
+// endpoint is ready again for it
+static inline void usb_control_continue(uint8_t intbits)
+{
+	uint8_t i, n;
+
+	if (control_state == CONTROL_DATA_IN) {
+		if (intbits & (1<<RXOUTI)) {	// the host aborts
+			usb_control_done();
+			return;
+		}
+		if (!(intbits & (1<<TXINI))) return;
+		n = control_length < ENDPOINT0_SIZE ? control_length : ENDPOINT0_SIZE;
+		for (i = n; i; i--) {
+			UEDATX = pgm_read_byte(control_addr++);
+		}
+		control_length -= n;
+		usb_send_in();
+		// a full packet at the end is followed by an empty one
+		if (!control_length && n < ENDPOINT0_SIZE) usb_control_done();
+		return;
+	}
+	if (control_state == CONTROL_SET_ADDRESS) {
+		if (!(intbits & (1<<TXINI))) return;
+		UDADDR = control_address | (1<<ADDEN);
+		usb_control_done();
+		return;
+	}
+	if (control_state == CONTROL_SET_REPORT) {
+		if (!(intbits & (1<<RXOUTI))) return;
+		i = UEDATX;
+		if (i != keyboard_leds) keyboard_led_change_count++;
+		// the first LEDs after a reset are the state of the host,
+		// not a toggle
+		if (((i ^ keyboard_leds) & keyboard_flow_led)
+		  && (keyboard_ready_events & KEYBOARD_READY_LEDS)) {
+			keyboard_flow_paused ^= 1;
+		}
+		keyboard_leds = i;
+		keyboard_ready_events |= KEYBOARD_READY_LEDS;
+		usb_ack_out();
+		usb_send_in();
+		usb_control_done();
+		return;
+	}
+}
+
+// the control request on endpoint 0, a function of its own so the
+// interrupt above has only one exit for the debug pin
+static inline void usb_control_request(void)
 {
         uint8_t intbits;
-	const uint8_t *list;
         const uint8_t *cfg;
-	uint8_t i, n, len, en;
+	const volatile uint8_t *p;
+	uint8_t i, en;
 	uint8_t bmRequestType;
 	uint8_t bRequest;
 	uint16_t wValue;
 	uint16_t wIndex;
 	uint16_t wLength;
-	uint16_t desc_val;
-	const uint8_t *desc_addr;
-	uint8_t	desc_length;
 
         UENUM = 0;
 	intbits = UEINTX;
+	if (control_state != CONTROL_IDLE && !(intbits & (1<<RXSTPI))) {
+		// no new request, go on with the one before
+		usb_control_continue(intbits);
+		return;
+	}
         if (intbits & (1<<RXSTPI)) {
+		// a new setup packet ends any transfer not yet done
+		usb_control_done();
                 bmRequestType = UEDATX;
                 bRequest = UEDATX;
                 wValue = UEDATX;
@@ -435,51 +992,27 @@ ISR(USB_COM_vect)
                 wLength |= (UEDATX << 8);
                 UEINTX = ~((1<<RXSTPI) | (1<<RXOUTI) | (1<<TXINI));
                 if (bRequest == GET_DESCRIPTOR) {
-			list = (const uint8_t *)descriptor_list;
-			for (i=0; ; i++) {
-				if (i >= NUM_DESC_LIST) {
-					UECONX = (1<<STALLRQ)|(1<<EPEN);  //stall
-					return;
-				}
-				desc_val = pgm_read_word(list);
-				if (desc_val != wValue) {
-					list += sizeof(struct descriptor_list_struct);
-					continue;
-				}
-				list += 2;
-				desc_val = pgm_read_word(list);
-				if (desc_val != wIndex) {
-					list += sizeof(struct descriptor_list_struct)-2;
-					continue;
-				}
-				list += 2;
-				desc_addr = (const uint8_t *)pgm_read_word(list);
-				list += 2;
-				desc_length = pgm_read_byte(list);
-				break;
+			i = usb_descriptor_index(wValue, wIndex);
+			if (i >= NUM_DESC_LIST) {
+				UECONX = (1<<STALLRQ)|(1<<EPEN);  //stall
+				return;
 			}
-			len = (wLength < 256) ? wLength : 255;
-			if (len > desc_length) len = desc_length;
-			do {
-				// wait for host ready for IN packet
-				do {
-					i = UEINTX;
-				} while (!(i & ((1<<TXINI)|(1<<RXOUTI))));
-				if (i & (1<<RXOUTI)) return;	// abort
-				// send IN packet
-				n = len < ENDPOINT0_SIZE ? len : ENDPOINT0_SIZE;
-				for (i = n; i; i--) {
-					UEDATX = pgm_read_byte(desc_addr++);
-				}
-				len -= n;
-				usb_send_in();
-			} while (len || n == ENDPOINT0_SIZE);
+			control_addr = (const uint8_t *)pgm_read_word(&descriptor_list[i].addr);
+			control_length = pgm_read_byte(&descriptor_list[i].length);
+			if (wLength < control_length) control_length = wLength;
+			// the first packet goes out now, the others each time
+			// the host has taken the one before
+			control_state = CONTROL_DATA_IN;
+			UEIENX = (1<<RXSTPE)|(1<<TXINE);
+			usb_control_continue(UEINTX);
 			return;
                 }
 		if (bRequest == SET_ADDRESS) {
+			// the address is set after the host has the status
 			usb_send_in();
-			usb_wait_in_ready();
-			UDADDR = wValue | (1<<ADDEN);
+			control_address = wValue;
+			control_state = CONTROL_SET_ADDRESS;
+			UEIENX = (1<<RXSTPE)|(1<<TXINE);
 			return;
 		}
 		if (bRequest == SET_CONFIGURATION && bmRequestType == 0) {
@@ -539,47 +1072,52 @@ ISR(USB_COM_vect)
 			}
 		}
 		#endif
-		if (wIndex == KEYBOARD_INTERFACE) {
+		if (wIndex < KEYBOARD_INTERFACES) {
 			if (bmRequestType == 0xA1) {
 				if (bRequest == HID_GET_REPORT) {
 					usb_wait_in_ready();
-					UEDATX = keyboard_modifier_keys;
-					UEDATX = 0;
-					for (i=0; i<6; i++) {
-						UEDATX = keyboard_keys[i];
+					if ((wValue >> 8) == 3) {
+						// the feature report with the counters
+						p = (const volatile uint8_t *)&keyboard_stats;
+						for (i=0; i<sizeof(keyboard_stats) && i<wLength; i++) {
+							UEDATX = p[i];
+						}
+					} else {
+						usb_keyboard_write_report(wIndex);
 					}
 					usb_send_in();
 					return;
 				}
 				if (bRequest == HID_GET_IDLE) {
 					usb_wait_in_ready();
-					UEDATX = keyboard_idle_config;
+					UEDATX = keyboard_idle_config[wIndex];
 					usb_send_in();
 					return;
 				}
 				if (bRequest == HID_GET_PROTOCOL) {
 					usb_wait_in_ready();
-					UEDATX = keyboard_protocol;
+					UEDATX = keyboard_protocol[wIndex];
 					usb_send_in();
 					return;
 				}
 			}
 			if (bmRequestType == 0x21) {
-				if (bRequest == HID_SET_REPORT) {
-					usb_wait_receive_out();
-					keyboard_leds = UEDATX;
-					usb_ack_out();
-					usb_send_in();
+				if (bRequest == HID_SET_REPORT && (wValue >> 8) == 2) {
+					// the LEDs follow in the data stage, the
+					// counters can not be written, it stalls
+					control_state = CONTROL_SET_REPORT;
+					UEIENX = (1<<RXSTPE)|(1<<RXOUTE);
 					return;
 				}
 				if (bRequest == HID_SET_IDLE) {
-					keyboard_idle_config = (wValue >> 8);
-					keyboard_idle_count = 0;
+					keyboard_idle_config[wIndex] = (wValue >> 8);
+					keyboard_idle_count[wIndex] = 0;
+					keyboard_ready_events |= KEYBOARD_READY_IDLE;
 					usb_send_in();
 					return;
 				}
 				if (bRequest == HID_SET_PROTOCOL) {
-					keyboard_protocol = wValue;
+					keyboard_protocol[wIndex] = wValue;
 					usb_send_in();
 					return;
 				}
@@ -5,12 +5,66 @@
 
 void usb_init(void);			// initialize everything
 uint8_t usb_configured(void);		// is the USB port configured
+uint16_t usb_frame_clock(void);		// milliseconds, counted by the frames
+uint8_t usb_suspended(void);		// is the bus suspended by the host
+uint8_t usb_resets(void);		// how often the bus was reset
 
 int8_t usb_keyboard_press(uint8_t key, uint8_t modifier);
+void usb_keyboard_key_down(uint8_t key);	// press a key, see keyboard_key_bitmap
+void usb_keyboard_release_all(void);		// release all keys and modifiers
 int8_t usb_keyboard_send(void);
+int8_t usb_keyboard_send_on(uint8_t flags);	// interface | KEYBOARD_SAME_FRAME, 1 if full
+uint8_t usb_keyboard_queue_depth(void);		// reports waiting for the host
+uint16_t usb_keyboard_full_waits(void);	// reports which waited on a full queue
+uint16_t usb_keyboard_sent(void);		// reports taken out of the queue
+uint16_t usb_keyboard_taken(void);		// reports the host has taken
+void usb_keyboard_count_retry(void);		// a report is sent again after a timeout
+void usb_keyboard_set_gap(uint8_t frames);	// empty frames between two reports
+void usb_keyboard_flow_control(uint8_t led);	// host pauses us by toggling the LED
+uint8_t usb_keyboard_paused(void);		// the host has paused us
+uint8_t usb_keyboard_led_changes(void);		// how often keyboard_leds changed
+uint8_t usb_keyboard_ready(void);		// KEYBOARD_READY_* seen since the reset
 extern uint8_t keyboard_modifier_keys;
-extern uint8_t keyboard_keys[6];
+// Number of keyboard interfaces, 1 or 2.  With 2 the host sees two
+// keyboards, each on its own endpoint, see usb_keyboard_send_on()
+#ifndef KEYBOARD_INTERFACES
+#define KEYBOARD_INTERFACES	1
+#endif
+#define KEYBOARD_INTERFACE_MASK	0x01
+// reports a bus reset can drop from the double buffered endpoints
+// after usb_keyboard_sent() has counted them
+#define KEYBOARD_BANKS		(2 * KEYBOARD_INTERFACES)
+#define KEYBOARD_SAME_FRAME	0x80
+
+#define KEYBOARD_BITMAP_SIZE	14	// one bit for each key code 0-111
+extern uint8_t keyboard_key_bitmap[KEYBOARD_BITMAP_SIZE];
 extern volatile uint8_t keyboard_leds;
+#define KEYBOARD_LED_NUM_LOCK		0x01
+#define KEYBOARD_LED_CAPS_LOCK		0x02
+#define KEYBOARD_LED_SCROLL_LOCK	0x04
+
+// The counters the host reads with a HID_GET_REPORT feature request,
+// on the real firmware and on the host with the keyboard_stats tool.
+// All values are little endian and count since the power up.
+#define KEYBOARD_STATS_WAITS	8
+struct keyboard_stats_struct {
+	uint16_t sent;		// reports written into the endpoints
+	uint16_t bank_wait;	// frames a report waited for a free endpoint bank
+	uint16_t full_waits;	// a report found the queue full for 50 frames and waited
+	uint16_t retries;	// reports sent again, see usb_keyboard_count_retry()
+	uint16_t isr_cycles;	// longest USB interrupt in CPU cycles
+	uint8_t queue_high;	// most reports in the queue at the same time
+	uint8_t reserved;
+	// reports by the frames from the queue to the endpoint:
+	// 0, 1, 2, 3-4, 5-8, 9-16, 17-32 and more
+	uint16_t waits[KEYBOARD_STATS_WAITS];
+};
+
+// What the host has done since the last bus reset, a driver which
+// does any of them is loaded and about to read the keystrokes
+#define KEYBOARD_READY_IDLE	0x01	// HID_SET_IDLE
+#define KEYBOARD_READY_LEDS	0x02	// HID_SET_REPORT with the LEDs
+#define KEYBOARD_READY_POLL	0x04	// IN token on the keyboard endpoint
 
 // This file does not include the HID debug functions, so these empty
 // macros replace them with nothing, so users can compile code that